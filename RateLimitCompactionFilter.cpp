@@ -25,7 +25,9 @@ bool RateLimitCompactionFilter::Filter(int level, const rocksdb::Slice& key, con
       std::chrono::system_clock::now().time_since_epoch()).count();
   RedisIntType idleTimeMs = nowMs - valueParams.lastReducedAtMs;
 
-  if (idleTimeMs / keyParams.refillTimeMs * keyParams.refillAmount >= keyParams.maxAmount) {
+  // a bucket in debt from reservations needs to pay that back before it can be full again
+  RedisIntType debt = std::max(0L, -valueParams.amount);
+  if (RateLimitHandler::isRefilledAfter(keyParams, idleTimeMs, debt)) {
     // we would have a full bucket anyway, so no longer need the key
     return true;
   }
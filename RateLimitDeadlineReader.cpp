@@ -0,0 +1,70 @@
+#include "ratelimit/RateLimitDeadlineReader.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+
+#include "rocksdb/options.h"
+
+namespace ratelimit {
+
+RateLimitDeadlineReader::RateLimitDeadlineReader(rocksdb::DB* db) : db_(db) {
+  for (int i = 0; i < kThreads; i++) threads_.emplace_back(&RateLimitDeadlineReader::run, this);
+}
+
+RateLimitDeadlineReader::~RateLimitDeadlineReader() {
+  {
+    std::lock_guard<std::mutex> _guard(mutex_);
+    stopping_ = true;
+  }
+  readCv_.notify_all();
+  for (auto& thread : threads_) thread.join();
+}
+
+rocksdb::Status RateLimitDeadlineReader::get(const rocksdb::Slice& key,
+                                             std::chrono::steady_clock::time_point deadline, std::string* value) {
+  // most buckets are hot, so try the memtables and the block cache without touching the disk first
+  rocksdb::ReadOptions readOptions;
+  readOptions.read_tier = rocksdb::kBlockCacheTier;
+  rocksdb::Status status = db_->Get(readOptions, key, value);
+  if (!status.IsIncomplete()) return status;
+
+  auto read = std::make_shared<Read>();
+  read->key = key.ToString();
+  std::unique_lock<std::mutex> lock(mutex_);
+  if (pendingReads_.size() >= kMaxPendingReads) return rocksdb::Status::Incomplete("Too many pending reads");
+  pendingReads_.push_back(read);
+  readCv_.notify_one();
+  if (!doneCv_.wait_until(lock, deadline, [&read] { return read->done; })) {
+    // the read stays queued, and warms the cache for the next request once it is done
+    return rocksdb::Status::Incomplete("Read deadline exceeded");
+  }
+  *value = std::move(read->value);
+  return read->status;
+}
+
+void RateLimitDeadlineReader::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    readCv_.wait(lock, [this] { return stopping_ || !pendingReads_.empty(); });
+    if (stopping_) return;
+    std::shared_ptr<Read> read = std::move(pendingReads_.front());
+    pendingReads_.pop_front();
+
+    lock.unlock();
+    std::string value;
+    rocksdb::Status status = db_->Get(rocksdb::ReadOptions(), read->key, &value);
+    lock.lock();
+    read->status = std::move(status);
+    read->value = std::move(value);
+    read->done = true;
+    doneCv_.notify_all();
+  }
+}
+
+constexpr int RateLimitDeadlineReader::kThreads;
+constexpr size_t RateLimitDeadlineReader::kMaxPendingReads;
+
+}  // namespace ratelimit
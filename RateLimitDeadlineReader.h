@@ -0,0 +1,59 @@
+#ifndef RATELIMIT_RATELIMITDEADLINEREADER_H_
+#define RATELIMIT_RATELIMITDEADLINEREADER_H_
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rocksdb/db.h"
+#include "rocksdb/slice.h"
+#include "rocksdb/status.h"
+
+namespace ratelimit {
+
+// Reads that give up at a deadline, for `--ratelimit_deadline_ms`.
+// RocksDB cannot cancel a Get that is waiting on the disk, so reads that miss the memtables and the block cache are
+// handed to a few background threads, and the caller only waits for them until its deadline. A read that finishes
+// late still fills the block cache, so the next request for the same key is answered in time.
+class RateLimitDeadlineReader {
+ public:
+  // `db` must outlive the reader
+  explicit RateLimitDeadlineReader(rocksdb::DB* db);
+  ~RateLimitDeadlineReader();
+
+  // Same as `DB::Get`, except that it returns `Incomplete` once `deadline` passes
+  rocksdb::Status get(const rocksdb::Slice& key, std::chrono::steady_clock::time_point deadline, std::string* value);
+
+ private:
+  static constexpr int kThreads = 4;
+  // reads beyond this many are not queued, since they would miss their deadline anyway
+  static constexpr size_t kMaxPendingReads = 1024;
+
+  struct Read {
+    std::string key;
+    bool done = false;
+    rocksdb::Status status;
+    std::string value;
+  };
+
+  void run();
+
+  rocksdb::DB* db_;
+
+  std::mutex mutex_;
+  // signals readers about new reads and callers about finished ones
+  std::condition_variable readCv_;
+  std::condition_variable doneCv_;
+  std::deque<std::shared_ptr<Read>> pendingReads_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
+
+}  // namespace ratelimit
+
+#endif  // RATELIMIT_RATELIMITDEADLINEREADER_H_
@@ -0,0 +1,188 @@
+#include "ratelimit/RateLimitDeltaCrdt.h"
+
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include "folly/Conv.h"
+
+#include "ratelimit/RateLimitHandler.h"
+
+namespace ratelimit {
+
+RateLimitDeltaCrdt::RateLimitDeltaCrdt(std::string nodeId, RateLimitDeltaCrdt::RedisIntType startedAtMs)
+    : nodeId_(std::move(nodeId)), startedAtMs_(startedAtMs), stripes_(new Stripe[kStripes]) {
+  // our own previous incarnations are superseded from the start
+  checkIncarnation(nodeId_);
+}
+
+void RateLimitDeltaCrdt::recordLocal(const std::string& key, RateLimitDeltaCrdt::RedisIntType tokens,
+                                     RateLimitDeltaCrdt::RedisIntType nowMs) {
+  if (tokens <= 0) return;
+  Stripe& stripe = stripeFor(key);
+  std::lock_guard<std::mutex> _guard(stripe.mutex);
+  auto inserted = stripe.counters[key].emplace(nodeId_, CounterState{ nowMs, 0, nowMs });
+  CounterState& local = inserted.first->second;
+  local.count += tokens;
+  local.updatedAtMs = nowMs;
+  stripe.dirtyKeys.insert(key);
+}
+
+RateLimitDeltaCrdt::RedisIntType RateLimitDeltaCrdt::merge(const std::string& nodeId,
+                                                           const RateLimitDeltaCrdt::Counter& counter,
+                                                           RateLimitDeltaCrdt::RedisIntType nowMs) {
+  // our own counter is authoritative locally, never let a peer echo it back
+  if (nodeId == nodeId_) return 0;
+  if (!checkIncarnation(nodeId)) return 0;
+
+  Stripe& stripe = stripeFor(counter.key);
+  std::lock_guard<std::mutex> _guard(stripe.mutex);
+  auto& nodes = stripe.counters[counter.key];
+  auto it = nodes.find(nodeId);
+  if (it == nodes.end()) {
+    nodes.emplace(nodeId, CounterState{ counter.epochMs, counter.count, nowMs });
+    // A run that started before this process did may already be applied to its buckets, which outlive restarts,
+    // and a run old enough for its bucket to have refilled was pruned here before. Either way only later increments
+    // count. Note that epochs come from the peer's clock, so clock skew between nodes shifts this cut-off.
+    if (counter.epochMs < startedAtMs_ || isRefilledAfter(counter.key, nowMs - counter.epochMs)) return 0;
+    return counter.count;
+  }
+
+  CounterState& seen = it->second;
+  // a run the peer has already replaced with a newer one
+  if (counter.epochMs < seen.epochMs) return 0;
+  RedisIntType delta;
+  if (counter.epochMs > seen.epochMs) {
+    // the peer pruned the previous run, so all of the new one is fresh
+    delta = counter.count;
+  } else if (counter.count > seen.count) {
+    delta = counter.count - seen.count;
+  } else {
+    return 0;
+  }
+  seen = CounterState{ counter.epochMs, counter.count, nowMs };
+  return delta;
+}
+
+void RateLimitDeltaCrdt::unmerge(const std::string& nodeId, const RateLimitDeltaCrdt::Counter& counter,
+                                 RateLimitDeltaCrdt::RedisIntType delta) {
+  Stripe& stripe = stripeFor(counter.key);
+  std::lock_guard<std::mutex> _guard(stripe.mutex);
+  auto nodesIt = stripe.counters.find(counter.key);
+  if (nodesIt == stripe.counters.end()) return;
+  auto it = nodesIt->second.find(nodeId);
+  // A newer run replaced this one meanwhile, which the peer only starts once the bucket would have refilled anyway.
+  // Otherwise later merges only counted what came on top of `counter`, so lowering the count is enough either way.
+  if (it == nodesIt->second.end() || it->second.epochMs != counter.epochMs) return;
+  it->second.count -= delta;
+}
+
+RateLimitDeltaCrdt::Counters RateLimitDeltaCrdt::takeDirtyCounters() {
+  Counters counters;
+  for (size_t i = 0; i < kStripes; i++) {
+    Stripe& stripe = stripes_[i];
+    std::lock_guard<std::mutex> _guard(stripe.mutex);
+    for (const auto& key : stripe.dirtyKeys) {
+      const CounterState& local = stripe.counters[key][nodeId_];
+      counters.push_back(Counter{ key, local.epochMs, local.count });
+    }
+    stripe.dirtyKeys.clear();
+  }
+  return counters;
+}
+
+RateLimitDeltaCrdt::Counters RateLimitDeltaCrdt::localCounters() const {
+  Counters counters;
+  for (size_t i = 0; i < kStripes; i++) {
+    Stripe& stripe = stripes_[i];
+    std::lock_guard<std::mutex> _guard(stripe.mutex);
+    for (const auto& entry : stripe.counters) {
+      auto it = entry.second.find(nodeId_);
+      if (it != entry.second.end()) counters.push_back(Counter{ entry.first, it->second.epochMs, it->second.count });
+    }
+  }
+  return counters;
+}
+
+size_t RateLimitDeltaCrdt::prune(RateLimitDeltaCrdt::RedisIntType nowMs) {
+  size_t pruned = 0;
+  for (size_t i = 0; i < kStripes; i++) {
+    Stripe& stripe = stripes_[i];
+    std::lock_guard<std::mutex> _guard(stripe.mutex);
+    for (auto it = stripe.counters.begin(); it != stripe.counters.end();) {
+      auto& nodes = it->second;
+      for (auto nodeIt = nodes.begin(); nodeIt != nodes.end();) {
+        bool unsent = nodeIt->first == nodeId_ && stripe.dirtyKeys.count(it->first) > 0;
+        if (!unsent && isRefilledAfter(it->first, nowMs - nodeIt->second.updatedAtMs)) {
+          nodeIt = nodes.erase(nodeIt);
+          pruned++;
+        } else {
+          ++nodeIt;
+        }
+      }
+      it = nodes.empty() ? stripe.counters.erase(it) : std::next(it);
+    }
+  }
+  return pruned;
+}
+
+bool RateLimitDeltaCrdt::isRefilledAfter(const std::string& key, RateLimitDeltaCrdt::RedisIntType idleTimeMs) {
+  RateLimitHandler::KeyParams keyParams;
+  if (!RateLimitHandler::decodeRateLimitKey(key, &keyParams) || keyParams.maxAmount < 1 ||
+      keyParams.refillAmount < 1 || keyParams.refillTimeMs < 1) {
+    return true;
+  }
+  return RateLimitHandler::isRefilledAfter(keyParams, idleTimeMs, 0);
+}
+
+void RateLimitDeltaCrdt::parseNodeId(const std::string& nodeId, std::string* name,
+                                     RateLimitDeltaCrdt::RedisIntType* startedAtMs) {
+  size_t at = nodeId.rfind('@');
+  *startedAtMs = 0;
+  if (at != std::string::npos) {
+    try {
+      *startedAtMs = folly::to<RedisIntType>(nodeId.substr(at + 1));
+      *name = nodeId.substr(0, at);
+      return;
+    } catch (std::range_error&) {
+      // not an incarnation suffix, so part of the name
+    }
+  }
+  *name = nodeId;
+}
+
+bool RateLimitDeltaCrdt::checkIncarnation(const std::string& nodeId) {
+  std::string name;
+  RedisIntType startedAtMs;
+  parseNodeId(nodeId, &name, &startedAtMs);
+  std::lock_guard<std::mutex> _guard(incarnationsMutex_);
+  auto inserted = incarnations_.emplace(name, nodeId);
+  std::string& latest = inserted.first->second;
+  if (inserted.second || latest == nodeId) return true;
+
+  std::string latestName;
+  RedisIntType latestStartedAtMs;
+  parseNodeId(latest, &latestName, &latestStartedAtMs);
+  if (startedAtMs < latestStartedAtMs) return false;
+  // The node restarted, so its previous incarnation will never send anything again. The restart only happens once
+  // per incarnation, so scanning all counters for it is cheap enough. A merge from the previous incarnation that
+  // raced with this scan may still leave a counter behind, which is pruned like any other.
+  for (size_t i = 0; i < kStripes; i++) {
+    Stripe& stripe = stripes_[i];
+    std::lock_guard<std::mutex> stripeGuard(stripe.mutex);
+    for (auto it = stripe.counters.begin(); it != stripe.counters.end();) {
+      it->second.erase(latest);
+      it = it->second.empty() ? stripe.counters.erase(it) : std::next(it);
+    }
+  }
+  latest = nodeId;
+  return true;
+}
+
+constexpr size_t RateLimitDeltaCrdt::kStripes;
+
+}  // namespace ratelimit
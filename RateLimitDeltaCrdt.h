@@ -0,0 +1,99 @@
+#ifndef RATELIMIT_RATELIMITDELTACRDT_H_
+#define RATELIMIT_RATELIMITDELTACRDT_H_
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "codec/RedisValue.h"
+
+namespace ratelimit {
+
+// Tokens consumed per bucket, kept as one grow-only counter per node (a G-Counter CRDT).
+// Buckets are identified by their encoded RocksDB keys, so the rate limit configuration is part of the identity.
+// Merging a peer counter keeps the per-node maximum, which makes merges commutative, associative and idempotent:
+// peers can exchange state in any order, any number of times, and still converge.
+//
+// Counters are only relevant until their bucket would have fully refilled, so they are pruned after that and the
+// next consumption starts a new run of the counter. Runs are told apart by their epoch, the time they started at.
+// Node ids are `name@startedAtMs`, one per process incarnation; a newer incarnation of a node supersedes older ones.
+class RateLimitDeltaCrdt {
+ public:
+  using RedisIntType = codec::RedisValue::IntType;
+  struct Counter {
+    std::string key;
+    RedisIntType epochMs;
+    RedisIntType count;
+  };
+  using Counters = std::vector<Counter>;
+
+  RateLimitDeltaCrdt(std::string nodeId, RedisIntType startedAtMs);
+
+  const std::string& nodeId() const { return nodeId_; }
+
+  // Add tokens consumed on this node to the counter of the given bucket
+  void recordLocal(const std::string& key, RedisIntType tokens, RedisIntType nowMs);
+
+  // Merge a counter received from a peer node and return the number of tokens the peer consumed since the last merge
+  // Stale or duplicated counters return 0
+  RedisIntType merge(const std::string& nodeId, const Counter& counter, RedisIntType nowMs);
+  // Take back the `delta` tokens a merge of `counter` returned when they could not be applied, so that the peer
+  // sending its counter again returns them again
+  void unmerge(const std::string& nodeId, const Counter& counter, RedisIntType delta);
+
+  // Local counters changed since the last call, i.e. the delta to gossip to peers
+  Counters takeDirtyCounters();
+  // All local counters, used to resynchronize a peer that may have missed deltas
+  Counters localCounters() const;
+
+  // Forget counters whose bucket would have fully refilled since they last changed and return how many were removed
+  // Local counters not gossiped yet are kept
+  size_t prune(RedisIntType nowMs);
+
+ private:
+  struct CounterState {
+    RedisIntType epochMs;
+    RedisIntType count;
+    // local time of the last change, which is what pruning goes by
+    RedisIntType updatedAtMs;
+  };
+
+  static constexpr size_t kStripes = 64;
+
+  // Counters are spread over independently locked stripes by bucket key, so that reduces of different buckets rarely
+  // wait on each other to record their tokens
+  struct Stripe {
+    std::mutex mutex;
+    // Bucket key => node id => counter of that node
+    std::unordered_map<std::string, std::unordered_map<std::string, CounterState>> counters;
+    // Bucket keys whose local counter changed since the last gossip round
+    std::unordered_set<std::string> dirtyKeys;
+  };
+
+  // Whether the bucket stored under `key` would be full again after `idleTimeMs`, also true for malformed keys
+  static bool isRefilledAfter(const std::string& key, RedisIntType idleTimeMs);
+  // Split `nodeId` into its name and start time, which is 0 when the id does not have one
+  static void parseNodeId(const std::string& nodeId, std::string* name, RedisIntType* startedAtMs);
+  // Track the latest incarnation of each node and drop counters of incarnations it supersedes
+  // Returns false for an incarnation that is already superseded itself
+  bool checkIncarnation(const std::string& nodeId);
+
+  Stripe& stripeFor(const std::string& key) const { return stripes_[std::hash<std::string>()(key) % kStripes]; }
+
+  const std::string nodeId_;
+  const RedisIntType startedAtMs_;
+  std::unique_ptr<Stripe[]> stripes_;
+  // Taken before any stripe lock, never while holding one
+  std::mutex incarnationsMutex_;
+  // Node name => id of its latest incarnation seen
+  std::unordered_map<std::string, std::string> incarnations_;
+};
+
+}  // namespace ratelimit
+
+#endif  // RATELIMIT_RATELIMITDELTACRDT_H_
@@ -0,0 +1,182 @@
+#include "ratelimit/RateLimitGossiper.h"
+
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "folly/Conv.h"
+#include "glog/logging.h"
+
+namespace ratelimit {
+
+namespace {
+
+void appendBulkString(const std::string& str, std::string* buf) {
+  folly::toAppend('$', str.size(), "\r\n", str, "\r\n", buf);
+}
+
+}  // namespace
+
+RateLimitGossiper::RateLimitGossiper(RateLimitDeltaCrdt* crdt, const std::vector<std::string>& peers, int intervalMs)
+    : crdt_(crdt), intervalMs_(intervalMs) {
+  for (const auto& peer : peers) {
+    size_t colon = peer.rfind(':');
+    CHECK(colon != std::string::npos && colon > 0 && colon + 1 < peer.size())
+        << "Gossip peer must be in host:port format: " << peer;
+    peers_.push_back(Peer{ peer.substr(0, colon), peer.substr(colon + 1), -1, true });
+  }
+  thread_ = std::thread(&RateLimitGossiper::run, this);
+}
+
+RateLimitGossiper::~RateLimitGossiper() {
+  {
+    std::lock_guard<std::mutex> _guard(mutex_);
+    stopping_ = true;
+  }
+  stopCv_.notify_all();
+  thread_.join();
+  for (auto& peer : peers_) disconnectFromPeer(&peer);
+}
+
+void RateLimitGossiper::encodeMergeCommands(const std::string& nodeId, const RateLimitDeltaCrdt::Counters& counters,
+                                            std::vector<std::string>* messages) {
+  for (size_t start = 0; start < counters.size(); start += kMaxEntriesPerMessage) {
+    size_t end = std::min(counters.size(), start + kMaxEntriesPerMessage);
+    std::string message;
+    folly::toAppend('*', 2 + 3 * (end - start), "\r\n", &message);
+    appendBulkString("RL.MERGE", &message);
+    appendBulkString(nodeId, &message);
+    for (size_t i = start; i < end; i++) {
+      appendBulkString(counters[i].key, &message);
+      appendBulkString(folly::to<std::string>(counters[i].epochMs), &message);
+      appendBulkString(folly::to<std::string>(counters[i].count), &message);
+    }
+    messages->push_back(std::move(message));
+  }
+}
+
+void RateLimitGossiper::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopCv_.wait_for(lock, std::chrono::milliseconds(intervalMs_), [this] { return stopping_; })) {
+    lock.unlock();
+    gossipOnce();
+    lock.lock();
+  }
+}
+
+void RateLimitGossiper::gossipOnce() {
+  // keep the counters, and with them full syncs, down to buckets that have not refilled yet
+  crdt_->prune(std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count());
+
+  std::vector<std::string> deltaMessages;
+  encodeMergeCommands(crdt_->nodeId(), crdt_->takeDirtyCounters(), &deltaMessages);
+  // only computed when some peer needs it
+  std::vector<std::string> fullMessages;
+  bool fullMessagesEncoded = false;
+
+  for (auto& peer : peers_) {
+    if (peer.needsFullSync) {
+      if (!fullMessagesEncoded) {
+        encodeMergeCommands(crdt_->nodeId(), crdt_->localCounters(), &fullMessages);
+        fullMessagesEncoded = true;
+      }
+      peer.needsFullSync = !sendToPeer(&peer, fullMessages);
+    } else if (!sendToPeer(&peer, deltaMessages)) {
+      peer.needsFullSync = true;
+    }
+  }
+}
+
+bool RateLimitGossiper::sendToPeer(Peer* peer, const std::vector<std::string>& messages) {
+  if (peer->fd < 0 && !connectToPeer(peer)) return false;
+
+  for (const auto& message : messages) {
+    size_t written = 0;
+    while (written < message.size()) {
+      ssize_t n = ::send(peer->fd, message.data() + written, message.size() - written, MSG_NOSIGNAL);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        LOG(WARNING) << "Failed to send gossip to " << peer->host << ":" << peer->port;
+        disconnectFromPeer(peer);
+        return false;
+      }
+      written += n;
+    }
+
+    // every RL.MERGE gets exactly one single-line reply, either an integer or an error
+    std::string reply;
+    char c = 0;
+    while (c != '\n') {
+      ssize_t n = ::recv(peer->fd, &c, 1, 0);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        LOG(WARNING) << "Failed to read gossip reply from " << peer->host << ":" << peer->port;
+        disconnectFromPeer(peer);
+        return false;
+      }
+      reply.push_back(c);
+    }
+    if (reply[0] == '-') {
+      LOG(ERROR) << "Gossip rejected by " << peer->host << ":" << peer->port << ": " << reply;
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RateLimitGossiper::connectToPeer(Peer* peer) {
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* addrs = nullptr;
+  int rc = ::getaddrinfo(peer->host.c_str(), peer->port.c_str(), &hints, &addrs);
+  if (rc != 0) {
+    LOG(WARNING) << "Cannot resolve gossip peer " << peer->host << ": " << ::gai_strerror(rc);
+    return false;
+  }
+
+  // never let a slow peer hold up gossip for longer than one interval
+  struct timeval timeout;
+  timeout.tv_sec = intervalMs_ / 1000;
+  timeout.tv_usec = (intervalMs_ % 1000) * 1000;
+  for (struct addrinfo* addr = addrs; addr != nullptr; addr = addr->ai_next) {
+    int fd = ::socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+    if (fd < 0) continue;
+    ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (::connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) {
+      peer->fd = fd;
+      break;
+    }
+    ::close(fd);
+  }
+  ::freeaddrinfo(addrs);
+
+  if (peer->fd < 0) {
+    LOG(WARNING) << "Cannot connect to gossip peer " << peer->host << ":" << peer->port;
+    return false;
+  }
+  return true;
+}
+
+void RateLimitGossiper::disconnectFromPeer(Peer* peer) {
+  if (peer->fd >= 0) {
+    ::close(peer->fd);
+    peer->fd = -1;
+  }
+}
+
+constexpr size_t RateLimitGossiper::kMaxEntriesPerMessage;
+
+}  // namespace ratelimit
@@ -0,0 +1,56 @@
+#ifndef RATELIMIT_RATELIMITGOSSIPER_H_
+#define RATELIMIT_RATELIMITGOSSIPER_H_
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ratelimit/RateLimitDeltaCrdt.h"
+
+namespace ratelimit {
+
+// Periodically pushes local token counters to peer nodes as `RL.MERGE` commands over Redis protocol.
+// Only counters changed since the previous round are sent; a peer that missed a round (connection failure or restart)
+// gets the full local state on the next successful connection. Merging is idempotent, so resending is always safe.
+class RateLimitGossiper {
+ public:
+  // Keep each RL.MERGE command well within the argument limit of the command handler table
+  static constexpr size_t kMaxEntriesPerMessage = 512;
+
+  // `peers` are `host:port` strings
+  RateLimitGossiper(RateLimitDeltaCrdt* crdt, const std::vector<std::string>& peers, int intervalMs);
+  ~RateLimitGossiper();
+
+  // Encode counters as one or more `RL.MERGE nodeId key epoch count [key epoch count ...]` commands in Redis protocol
+  static void encodeMergeCommands(const std::string& nodeId, const RateLimitDeltaCrdt::Counters& counters,
+                                  std::vector<std::string>* messages);
+
+ private:
+  struct Peer {
+    std::string host;
+    std::string port;
+    int fd;
+    bool needsFullSync;
+  };
+
+  void run();
+  void gossipOnce();
+  bool sendToPeer(Peer* peer, const std::vector<std::string>& messages);
+  bool connectToPeer(Peer* peer);
+  void disconnectFromPeer(Peer* peer);
+
+  RateLimitDeltaCrdt* crdt_;
+  std::vector<Peer> peers_;
+  const int intervalMs_;
+
+  std::mutex mutex_;
+  std::condition_variable stopCv_;
+  bool stopping_ = false;
+  std::thread thread_;
+};
+
+}  // namespace ratelimit
+
+#endif  // RATELIMIT_RATELIMITGOSSIPER_H_
@@ -2,71 +2,626 @@
 
 #include <algorithm>
 #include <array>
+#include <chrono>
 #include <cstring>
 #include <functional>
 #include <memory>
 #include <mutex>
 #include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "boost/algorithm/string/case_conv.hpp"
 #include "folly/Conv.h"
 #include "folly/Format.h"
+#include "folly/SpookyHashV2.h"
+#include "folly/String.h"
+#include "gflags/gflags.h"
 #include "glog/logging.h"
 #include "rocksdb/options.h"
 #include "rocksdb/slice.h"
 #include "rocksdb/status.h"
+#include "rocksdb/write_batch.h"
+
+DEFINE_string(ratelimit_node_id, "",
+              "Enables multi-node mode, where buckets are enforced locally and consumed tokens are gossiped to peers. "
+              "Must be unique among peers");
+DEFINE_string(ratelimit_gossip_peers, "", "Comma separated host:port list of peers to gossip consumed tokens to");
+DEFINE_int32(ratelimit_gossip_interval_ms, 100,
+             "How often consumed tokens are gossiped to peers, which bounds how much peers can overshoot together");
+DEFINE_int32(ratelimit_deadline_ms, 0,
+             "Answer with --ratelimit_deadline_fallback instead of waiting when a request cannot acquire its key lock "
+             "or read its bucket within this many milliseconds, or when RocksDB would stall its write. 0 disables it");
+DEFINE_string(ratelimit_deadline_fallback, "allow",
+              "What to answer when --ratelimit_deadline_ms is exceeded: `allow` reports a full bucket, `deny` an "
+              "empty bucket, and `cached` the amount last seen for the key (or a full bucket when there is none)");
+
+DEFINE_bool(ratelimit_hash_key_names, false,
+            "Store a 128-bit hash of key names instead of the names themselves, which keeps long key names from "
+            "inflating memtables, index blocks and the block cache. Switching it resets all buckets");
+
+DEFINE_string(ratelimit_warm_snapshot_path, "",
+              "Where to write the keys of recently used buckets on clean shutdown, to preload them on startup before "
+              "serving traffic. Empty disables warm restarts");
+DEFINE_int32(ratelimit_warm_snapshot_active_secs, 600,
+             "Buckets reduced within this many seconds before shutdown make it into the warm snapshot");
+DEFINE_int32(ratelimit_warm_snapshot_max_keys, 1000000,
+             "How many of the most recently reduced keys are tracked in memory for the warm snapshot");
+
+DEFINE_string(ratelimit_overrides_path, "",
+              "Table of key name prefixes that are exempt from rate limiting or use a different configuration, built "
+              "by ratelimit_override_compiler. Empty disables overrides");
+DEFINE_int32(ratelimit_overrides_reload_ms, 1000, "How often the overrides table is checked for changes");
 
 namespace ratelimit {
 
+namespace {
+
+// Whether the optional arguments of `cmd` include `name`, which like all but `strict` is followed by a value
+bool hasOptionalArg(const std::vector<std::string>& cmd, const std::string& name) {
+  size_t i = 4;
+  while (i < cmd.size()) {
+    std::string argLower = boost::to_lower_copy(cmd[i]);
+    if (argLower == name) return true;
+    i += argLower == "strict" ? 1 : 2;
+  }
+  return false;
+}
+
+}  // namespace
+
+RateLimitHandler::RateLimitHandler(std::shared_ptr<pipeline::DatabaseManager> databaseManager)
+    : pipeline::RedisHandler(databaseManager),
+      mutexes_(new std::timed_mutex[kMaxConcurrentWriters]),
+      cachedAmounts_(new CachedAmount[kMaxConcurrentWriters]()),
+      deadlineMs_(FLAGS_ratelimit_deadline_ms),
+      hashKeyNames_(FLAGS_ratelimit_hash_key_names),
+      // lease ids of a previous incarnation are unlikely to be reused, so stale releases return nothing
+      nextLeaseId_(nowMs() << 20) {
+  CHECK(parseDeadlineFallback(FLAGS_ratelimit_deadline_fallback, &deadlineFallback_))
+      << "Unknown deadline fallback: " << FLAGS_ratelimit_deadline_fallback;
+  for (auto& count : deadlineFallbackCounts_) count.store(0);
+  if (deadlineMs_ > 0) deadlineReader_ = std::make_unique<RateLimitDeadlineReader>(db());
+
+  if (!FLAGS_ratelimit_node_id.empty()) {
+    // Counters restart from zero with the process, so every incarnation gossips as a new node. Otherwise peers that
+    // already saw higher counters from the previous incarnation would ignore consumption until it caught up.
+    RedisIntType startedAtMs = nowMs();
+    deltaCrdt_ = std::make_unique<RateLimitDeltaCrdt>(folly::sformat("{}@{}", FLAGS_ratelimit_node_id, startedAtMs),
+                                                      startedAtMs);
+    std::vector<std::string> peers;
+    folly::split(',', FLAGS_ratelimit_gossip_peers, peers, true);
+    if (!peers.empty()) {
+      CHECK_GT(FLAGS_ratelimit_gossip_interval_ms, 0) << "Gossip interval must be positive";
+      gossiper_ = std::make_unique<RateLimitGossiper>(deltaCrdt_.get(), peers, FLAGS_ratelimit_gossip_interval_ms);
+    }
+  }
+
+  if (!FLAGS_ratelimit_overrides_path.empty()) {
+    CHECK_GT(FLAGS_ratelimit_overrides_reload_ms, 0) << "Overrides reload interval must be positive";
+    overrides_ = std::make_unique<RateLimitOverrideReloader>(FLAGS_ratelimit_overrides_path,
+                                                             FLAGS_ratelimit_overrides_reload_ms);
+  }
+
+  // handlers are created before the server starts listening, so preloading delays the first connection
+  if (!FLAGS_ratelimit_warm_snapshot_path.empty()) {
+    CHECK_GT(FLAGS_ratelimit_warm_snapshot_max_keys, 0) << "Warm snapshot must keep at least one key";
+    recentKeys_ = std::make_unique<RateLimitRecentKeys>(FLAGS_ratelimit_warm_snapshot_max_keys);
+    rocksdb::Status status = RateLimitWarmSnapshot::preload(db(), FLAGS_ratelimit_warm_snapshot_path,
+                                                            &preloadedKeyCount_);
+    if (!status.ok()) LOG(ERROR) << "Cannot preload warm snapshot: " << status.ToString();
+  }
+}
+
+RateLimitHandler::~RateLimitHandler() {
+  if (recentKeys_) {
+    RedisIntType activeWithinMs = static_cast<RedisIntType>(FLAGS_ratelimit_warm_snapshot_active_secs) * 1000;
+    rocksdb::Status status = RateLimitWarmSnapshot::write(db(), FLAGS_ratelimit_warm_snapshot_path,
+                                                          recentKeys_->getRecentKeys(nowMs(), activeWithinMs));
+    if (!status.ok()) LOG(ERROR) << "Cannot write warm snapshot: " << status.ToString();
+  }
+}
+
 codec::RedisValue RateLimitHandler::getAndReduceTokens(const std::string& keyName, const RateLimitArgs& args,
                                                        bool strict, RateLimitHandler::SessionParams* sessionParams,
                                                        Context* ctx) {
   RedisIntType adjustedAmount;
-  // unlock ASAP (before writing the response to client)
-  {
-    // use hashed key name as mutex index to prevent concurrent writes
-    size_t mutexIndex = std::hash<std::string>()(keyName) % kMaxConcurrentWriters;
-    std::lock_guard<std::mutex> _guard(mutexes_[mutexIndex]);
+  rocksdb::Status status = reduceTokens(keyName, args, strict, sessionParams, &adjustedAmount);
+  if (!status.ok()) {
+    return errorResp(folly::sformat("RocksDB error: {}", status.ToString()));
+  }
+  return codec::RedisValue(adjustedAmount);
+}
 
-    std::string key;
-    RedisIntType newRefilledAtMs;
-    adjustedAmount = getAdjustedAmountFromDb(keyName, args, &key, &newRefilledAtMs, sessionParams);
-    if (args.tokenAmount > 0) {
-      RedisIntType newAmount = std::max(adjustedAmount - args.tokenAmount, 0L);
-      ValueParams valueParams{ newAmount, newRefilledAtMs, nowMs() };
-      // In strict mode, once new amount reaches 0, we stop refilling until client waited at least
-      // one full refill time by keeping advancing refilled at time to current client time
-      if (strict && newAmount == 0) valueParams.lastRefilledAtMs = args.clientTimeMs;
-      std::string valueBuf;
-      rocksdb::Slice newValue = encodeRateLimitValue(valueParams, &valueBuf);
-      if (sessionParams) {
-        if (adjustedAmount >= args.tokenAmount) {
-          // Start a new session when there are enough tokens remain
-          // Once tokens are exhausted, subsequent requests will get the same sessionStartedAtMs until refill
-          sessionParams->sessionStartedAtMs = args.clientTimeMs;
+codec::RedisValue RateLimitHandler::getAndReduceShardedTokens(const std::string& keyName, const RateLimitArgs& args,
+                                                              RateLimitHandler::RedisIntType shards, Context* ctx) {
+  // every sub-bucket needs at least one token and one token per refill
+  shards = std::min({ shards, args.maxAmount, args.refillAmount });
+  std::vector<RateLimitArgs> shardArgs;
+  std::vector<std::string> keys(shards);
+  std::vector<size_t> keyHashes;
+  for (RedisIntType shard = 0; shard < shards; shard++) {
+    shardArgs.push_back(getShardArgs(args, shard, shards));
+    KeyParams keyParams{ shardArgs[shard].maxAmount, shardArgs[shard].refillAmount, shardArgs[shard].refillTimeMs };
+    encodeRateLimitKey(getShardKeyName(keyName, shard, shards), keyParams, &keys[shard], hashKeyNames_);
+    keyHashes.push_back(std::hash<std::string>()(keys[shard]));
+  }
+  // threads stick to their own sub-bucket so that each sub-bucket is mostly locked by a single thread
+  static thread_local size_t threadSeed = std::hash<std::thread::id>()(std::this_thread::get_id());
+  RedisIntType homeShard = threadSeed % shards;
+  // fallbacks of a sharded bucket only know about the calling thread's sub-bucket
+  auto fallback = [&] { return codec::RedisValue(getFallbackAmount(keyHashes[homeShard], args)); };
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(deadlineMs_);
+  std::vector<RedisIntType> amounts(shards);
+  std::vector<RedisIntType> refilledAtMs(shards);
+
+  if (args.tokenAmount == 0) {
+    // Gets lock one sub-bucket at a time, so the total may mix sub-buckets read before and after a concurrent reduce.
+    // All of them share the deadline of the get.
+    RedisIntType totalAmount = 0;
+    for (RedisIntType shard = 0; shard < shards; shard++) {
+      std::unique_lock<std::timed_mutex> lock(mutexes_[keyHashes[shard] % kMaxConcurrentWriters], std::defer_lock);
+      if (!lockBucket(&lock, deadline) ||
+          !readBucket(keys[shard], shardArgs[shard], deadline, &amounts[shard], &refilledAtMs[shard], nullptr)) {
+        return fallback();
+      }
+      cacheAmount(keyHashes[shard], amounts[shard], refilledAtMs[shard]);
+      totalAmount += std::max(amounts[shard], 0L);
+    }
+    return codec::RedisValue(totalAmount);
+  }
+
+  // The home sub-bucket alone answers most reduces, and only its lock is taken. The total adds up the amounts the
+  // other sub-buckets were last written with, which are kept in memory, refilled to now.
+  {
+    std::unique_lock<std::timed_mutex> lock(mutexes_[keyHashes[homeShard] % kMaxConcurrentWriters], std::defer_lock);
+    if (!lockBucket(&lock, deadline) ||
+        !readBucket(keys[homeShard], shardArgs[homeShard], deadline, &amounts[homeShard], &refilledAtMs[homeShard],
+                    nullptr)) {
+      return fallback();
+    }
+    if (amounts[homeShard] >= args.tokenAmount) {
+      size_t homeSlot = keyHashes[homeShard] % kMaxConcurrentWriters;
+      RedisIntType totalAmount = amounts[homeShard];
+      for (RedisIntType shard = 0; shard < shards; shard++) {
+        if (shard == homeShard) continue;
+        RedisIntType cachedAmount;
+        RedisIntType cachedRefilledAtMs;
+        if (getCachedAmount(keyHashes[shard], &cachedAmount, &cachedRefilledAtMs)) {
+          amounts[shard] = adjustAmount(cachedAmount, cachedRefilledAtMs, shardArgs[shard], &refilledAtMs[shard]);
+        } else {
+          // Sub-buckets not written since startup, or whose slot another key took since, are read from storage.
+          // They are cached when their slot is free, never waiting for it while holding the home lock.
+          size_t slot = keyHashes[shard] % kMaxConcurrentWriters;
+          std::unique_lock<std::timed_mutex> shardLock(mutexes_[slot], std::defer_lock);
+          bool locked = slot == homeSlot || shardLock.try_lock();
+          // sub-buckets that cannot be read in time are left out, the total still covers the tokens taken
+          if (!readBucket(keys[shard], shardArgs[shard], deadline, &amounts[shard], &refilledAtMs[shard], nullptr)) {
+            continue;
+          }
+          if (locked) cacheAmount(keyHashes[shard], amounts[shard], refilledAtMs[shard]);
         }
-        newValue = encodeRateLimitValue(*sessionParams, &valueBuf);
+        totalAmount += std::max(amounts[shard], 0L);
       }
-      rocksdb::Status status = db()->Put(rocksdb::WriteOptions(), key, newValue);
-      if (!status.ok()) {
-        return errorResp(folly::sformat("RocksDB error: {}", status.ToString()));
+      RedisIntType newAmount = amounts[homeShard] - args.tokenAmount;
+      ValueParams valueParams{ newAmount, refilledAtMs[homeShard], nowMs() };
+      std::string valueBuf;
+      rocksdb::Status status = writeBucket(keys[homeShard], encodeRateLimitValue(valueParams, &valueBuf));
+      if (status.IsIncomplete()) return fallback();
+      if (!status.ok()) return errorResp(folly::sformat("RocksDB error: {}", status.ToString()));
+      if (deltaCrdt_) deltaCrdt_->recordLocal(keys[homeShard], args.tokenAmount, nowMs());
+      cacheAmount(keyHashes[homeShard], newAmount, refilledAtMs[homeShard]);
+      return codec::RedisValue(totalAmount);
+    }
+  }
+
+  // Otherwise lock every sub-bucket, in slot order so that concurrent reduces cannot deadlock. Sub-buckets may share
+  // a slot, which is only locked once as the mutexes are not recursive.
+  std::vector<size_t> slots;
+  for (size_t keyHash : keyHashes) slots.push_back(keyHash % kMaxConcurrentWriters);
+  std::sort(slots.begin(), slots.end());
+  slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+  std::vector<std::unique_lock<std::timed_mutex>> locks;
+  for (size_t slot : slots) {
+    locks.emplace_back(mutexes_[slot], std::defer_lock);
+    if (!lockBucket(&locks.back(), deadline)) return fallback();
+  }
+  RedisIntType totalAmount = 0;
+  for (RedisIntType shard = 0; shard < shards; shard++) {
+    if (!readBucket(keys[shard], shardArgs[shard], deadline, &amounts[shard], &refilledAtMs[shard], nullptr)) {
+      return fallback();
+    }
+    totalAmount += std::max(amounts[shard], 0L);
+  }
+  // a reduce the sub-buckets cannot cover together takes nothing from any of them
+  if (totalAmount < args.tokenAmount) return codec::RedisValue(totalAmount);
+
+  // Take the tokens and rebalance what is left over all sub-buckets by their shares, so that every thread finds
+  // tokens in its own sub-bucket again. All sub-buckets are written at once.
+  std::vector<RedisIntType> newAmounts = rebalanceShards(args, shards, totalAmount - args.tokenAmount);
+  rocksdb::WriteBatch batch;
+  RedisIntType reducedAtMs = nowMs();
+  for (RedisIntType shard = 0; shard < shards; shard++) {
+    ValueParams valueParams{ newAmounts[shard], refilledAtMs[shard], reducedAtMs };
+    std::string valueBuf;
+    batch.Put(keys[shard], encodeRateLimitValue(valueParams, &valueBuf));
+  }
+  rocksdb::WriteOptions writeOptions;
+  writeOptions.no_slowdown = deadlineMs_ > 0;
+  rocksdb::Status status = db()->Write(writeOptions, &batch);
+  if (status.IsIncomplete()) return fallback();
+  if (!status.ok()) return errorResp(folly::sformat("RocksDB error: {}", status.ToString()));
+  if (deltaCrdt_) {
+    // Peers apply each sub-bucket's decrease to their own copy of it, and only ever take tokens. Sub-buckets that
+    // went up are left out, and those that went down are charged no more than the tokens taken in total.
+    RedisIntType unchargedAmount = args.tokenAmount;
+    for (RedisIntType shard = 0; shard < shards && unchargedAmount > 0; shard++) {
+      RedisIntType chargedAmount = std::min(unchargedAmount, std::max(amounts[shard], 0L) - newAmounts[shard]);
+      if (chargedAmount <= 0) continue;
+      deltaCrdt_->recordLocal(keys[shard], chargedAmount, reducedAtMs);
+      unchargedAmount -= chargedAmount;
+    }
+  }
+  for (RedisIntType shard = 0; shard < shards; shard++) {
+    cacheAmount(keyHashes[shard], newAmounts[shard], refilledAtMs[shard]);
+    if (recentKeys_) recentKeys_->touch(keys[shard], reducedAtMs);
+  }
+  return codec::RedisValue(totalAmount);
+}
+
+std::vector<RateLimitHandler::RedisIntType> RateLimitHandler::rebalanceShards(
+    const RateLimitHandler::RateLimitArgs& args, RateLimitHandler::RedisIntType shards,
+    RateLimitHandler::RedisIntType amount) {
+  std::vector<RedisIntType> amounts;
+  RedisIntType remainder = amount;
+  for (RedisIntType shard = 0; shard < shards; shard++) {
+    amounts.push_back(amount * getShardArgs(args, shard, shards).maxAmount / args.maxAmount);
+    remainder -= amounts.back();
+  }
+  // rounding leaves less than one token per sub-bucket, which goes to the first ones with room for it
+  for (RedisIntType shard = 0; shard < shards && remainder > 0; shard++) {
+    if (amounts[shard] < getShardArgs(args, shard, shards).maxAmount) {
+      amounts[shard]++;
+      remainder--;
+    }
+  }
+  return amounts;
+}
+
+RateLimitHandler::RateLimitArgs RateLimitHandler::getShardArgs(const RateLimitHandler::RateLimitArgs& args,
+                                                               RateLimitHandler::RedisIntType shard,
+                                                               RateLimitHandler::RedisIntType shards) {
+  RateLimitArgs shardArgs = args;
+  // spread the remainders over the first sub-buckets so that the shares add up to the logical bucket
+  shardArgs.maxAmount = args.maxAmount / shards + (shard < args.maxAmount % shards ? 1 : 0);
+  shardArgs.refillAmount = args.refillAmount / shards + (shard < args.refillAmount % shards ? 1 : 0);
+  return shardArgs;
+}
+
+std::string RateLimitHandler::getShardKeyName(const std::string& keyName, RateLimitHandler::RedisIntType shard,
+                                              RateLimitHandler::RedisIntType shards) {
+  std::string shardKeyName = keyName;
+  // the NUL separator keeps sub-bucket names apart from any printable key name
+  shardKeyName.push_back('\0');
+  folly::toAppend("shard:", shard, '/', shards, &shardKeyName);
+  return shardKeyName;
+}
+
+rocksdb::Status RateLimitHandler::reduceTokens(const std::string& keyName, const RateLimitArgs& args, bool strict,
+                                               RateLimitHandler::SessionParams* sessionParams,
+                                               RateLimitHandler::RedisIntType* adjustedAmount, bool* fellBack) {
+  if (fellBack) *fellBack = false;
+  KeyParams keyParams{ args.maxAmount, args.refillAmount, args.refillTimeMs };
+  std::string key;
+  encodeRateLimitKey(keyName, keyParams, &key, hashKeyNames_);
+  size_t keyHash = std::hash<std::string>()(key);
+
+  std::unique_lock<std::timed_mutex> lock(mutexes_[keyHash % kMaxConcurrentWriters], std::defer_lock);
+  RedisIntType newRefilledAtMs;
+  if (!lockAndReadBucket(key, args, &lock, adjustedAmount, &newRefilledAtMs, sessionParams)) {
+    *adjustedAmount = getFallbackAmount(keyHash, args);
+    if (fellBack) *fellBack = true;
+    return rocksdb::Status::OK();
+  }
+  if (args.tokenAmount > 0) {
+    RedisIntType newAmount = reduceAmount(*adjustedAmount, args.tokenAmount);
+    ValueParams valueParams{ newAmount, newRefilledAtMs, nowMs() };
+    // In strict mode, once new amount reaches 0, we stop refilling until client waited at least
+    // one full refill time by keeping advancing refilled at time to current client time
+    if (strict && newAmount == 0) valueParams.lastRefilledAtMs = args.clientTimeMs;
+    std::string valueBuf;
+    rocksdb::Slice newValue = encodeRateLimitValue(valueParams, &valueBuf);
+    if (sessionParams) {
+      if (*adjustedAmount >= args.tokenAmount) {
+        // Start a new session when there are enough tokens remain
+        // Once tokens are exhausted, subsequent requests will get the same sessionStartedAtMs until refill
+        sessionParams->sessionStartedAtMs = args.clientTimeMs;
       }
+      newValue = encodeRateLimitValue(*sessionParams, &valueBuf);
+    }
+    rocksdb::Status status = writeBucket(key, newValue);
+    if (status.IsIncomplete()) {
+      *adjustedAmount = getFallbackAmount(keyHash, args);
+      if (fellBack) *fellBack = true;
+      return rocksdb::Status::OK();
     }
+    if (!status.ok()) return status;
+    if (deltaCrdt_) deltaCrdt_->recordLocal(key, *adjustedAmount - newAmount, nowMs());
+    cacheAmount(keyHash, newAmount, valueParams.lastRefilledAtMs);
+  } else {
+    cacheAmount(keyHash, *adjustedAmount, newRefilledAtMs);
   }
+  // no tokens are left while in debt
+  *adjustedAmount = std::max(*adjustedAmount, 0L);
+  return rocksdb::Status::OK();
+}
 
-  return codec::RedisValue(adjustedAmount);
+rocksdb::Status RateLimitHandler::reserveTokens(const std::string& keyName, const RateLimitArgs& args,
+                                                RateLimitHandler::RedisIntType timeoutMs,
+                                                RateLimitHandler::RedisIntType* waitMs) {
+  // more than the bucket can ever hold
+  if (args.tokenAmount > args.maxAmount) {
+    *waitMs = -1;
+    return rocksdb::Status::OK();
+  }
+  // nothing to reserve, even from a bucket in debt
+  if (args.tokenAmount == 0) {
+    *waitMs = 0;
+    return rocksdb::Status::OK();
+  }
+
+  KeyParams keyParams{ args.maxAmount, args.refillAmount, args.refillTimeMs };
+  std::string key;
+  encodeRateLimitKey(keyName, keyParams, &key, hashKeyNames_);
+  size_t keyHash = std::hash<std::string>()(key);
+
+  // a fallback amount short of the tokens means no reservation
+  std::unique_lock<std::timed_mutex> lock(mutexes_[keyHash % kMaxConcurrentWriters], std::defer_lock);
+  RedisIntType adjustedAmount;
+  RedisIntType newRefilledAtMs;
+  if (!lockAndReadBucket(key, args, &lock, &adjustedAmount, &newRefilledAtMs, nullptr)) {
+    *waitMs = getFallbackAmount(keyHash, args) >= args.tokenAmount ? 0 : -1;
+    return rocksdb::Status::OK();
+  }
+  if (adjustedAmount >= args.tokenAmount) {
+    *waitMs = 0;
+  } else {
+    // wait for the refill that covers the missing tokens, counting from the latest refill mark
+    RedisIntType refills = (args.tokenAmount - adjustedAmount + args.refillAmount - 1) / args.refillAmount;
+    *waitMs = std::max(0L, newRefilledAtMs + refills * args.refillTimeMs - args.clientTimeMs);
+  }
+  if (*waitMs > timeoutMs) {
+    *waitMs = -1;
+    return rocksdb::Status::OK();
+  }
+
+  // Take the tokens right away, even though it may leave the bucket in debt until the refill. Later callers then line
+  // up behind this one instead of racing for the same refill.
+  RedisIntType newAmount = adjustedAmount - args.tokenAmount;
+  ValueParams valueParams{ newAmount, newRefilledAtMs, nowMs() };
+  std::string valueBuf;
+  rocksdb::Status status = writeBucket(key, encodeRateLimitValue(valueParams, &valueBuf));
+  if (status.IsIncomplete()) {
+    *waitMs = getFallbackAmount(keyHash, args) >= args.tokenAmount ? 0 : -1;
+    return rocksdb::Status::OK();
+  }
+  if (!status.ok()) return status;
+  if (deltaCrdt_) deltaCrdt_->recordLocal(key, args.tokenAmount, nowMs());
+  cacheAmount(keyHash, newAmount, newRefilledAtMs);
+  return rocksdb::Status::OK();
+}
+
+bool RateLimitHandler::lockAndReadBucket(const std::string& key, const RateLimitHandler::RateLimitArgs& args,
+                                         std::unique_lock<std::timed_mutex>* lock,
+                                         RateLimitHandler::RedisIntType* adjustedAmount,
+                                         RateLimitHandler::RedisIntType* newRefilledAtMs,
+                                         RateLimitHandler::SessionParams* sessionParams, std::string* encodedValue) {
+  // the lock and storage share the deadline
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(deadlineMs_);
+  return lockBucket(lock, deadline) &&
+         readBucket(key, args, deadline, adjustedAmount, newRefilledAtMs, sessionParams, encodedValue);
+}
+
+bool RateLimitHandler::lockBucket(std::unique_lock<std::timed_mutex>* lock,
+                                  std::chrono::steady_clock::time_point deadline) {
+  // without a deadline, wait for the lock however long it takes
+  if (!deadlineReader_) {
+    lock->lock();
+    return true;
+  }
+  return lock->try_lock_until(deadline);
+}
+
+bool RateLimitHandler::readBucket(const std::string& key, const RateLimitHandler::RateLimitArgs& args,
+                                  std::chrono::steady_clock::time_point deadline,
+                                  RateLimitHandler::RedisIntType* adjustedAmount,
+                                  RateLimitHandler::RedisIntType* newRefilledAtMs,
+                                  RateLimitHandler::SessionParams* sessionParams, std::string* encodedValue) {
+  std::string value;
+  if (!encodedValue) encodedValue = &value;
+  rocksdb::Status status;
+  if (!deadlineReader_) {
+    status = db()->Get(rocksdb::ReadOptions(), key, encodedValue);
+  } else {
+    status = deadlineReader_->get(key, deadline, encodedValue);
+    if (status.IsIncomplete()) return false;
+  }
+  if (!status.ok()) encodedValue->clear();
+  *adjustedAmount = adjustStoredAmount(status, *encodedValue, args, newRefilledAtMs, sessionParams);
+  return true;
+}
+
+rocksdb::Status RateLimitHandler::writeBucket(const std::string& key, const rocksdb::Slice& value) {
+  rocksdb::WriteOptions writeOptions;
+  // fail fast with `Incomplete` instead of blocking on a write stall
+  writeOptions.no_slowdown = deadlineMs_ > 0;
+  rocksdb::Status status = db()->Put(writeOptions, key, value);
+  if (status.ok() && recentKeys_) recentKeys_->touch(key, nowMs());
+  return status;
+}
+
+codec::RedisValue RateLimitHandler::handleRecordCommand(const std::vector<std::string>& cmd, bool useMs,
+                                                        Context* ctx) {
+  RateLimitArgs args = {};
+  bool strict = false;
+  codec::RedisValue parseStatus = parseRateLimitArgs(cmd, useMs, true, &args, &strict);
+  if (parseStatus != simpleStringOk()) return parseStatus;
+  // strict mode needs to know whether the bucket runs dry, which is only known when the operands are merged
+  if (strict) return errorSyntaxError();
+  if (args.tokenAmount == 0 || applyOverrides(cmd[1], &args)) return simpleStringOk();
+
+  KeyParams keyParams{ args.maxAmount, args.refillAmount, args.refillTimeMs };
+  std::string key;
+  encodeRateLimitKey(cmd[1], keyParams, &key, hashKeyNames_);
+  size_t keyHash = std::hash<std::string>()(key);
+  // Other writers read the bucket and put it back whole under the lock, which would drop an operand merged in between
+  // The lock is only held for the merge itself, never for a read.
+  std::unique_lock<std::timed_mutex> lock(mutexes_[keyHash % kMaxConcurrentWriters], std::defer_lock);
+  if (!lockBucket(&lock, std::chrono::steady_clock::now() + std::chrono::milliseconds(deadlineMs_))) {
+    // the reply is always OK, so the fallback only decides nothing and the tokens go unrecorded
+    getFallbackAmount(keyHash, args);
+    return simpleStringOk();
+  }
+  MergeParams mergeParams{ args.tokenAmount, args.clientTimeMs, nowMs() };
+  std::string operandBuf;
+  rocksdb::WriteOptions writeOptions;
+  writeOptions.no_slowdown = deadlineMs_ > 0;
+  rocksdb::Status status = db()->Merge(writeOptions, key, encodeRateLimitValue(mergeParams, &operandBuf));
+  if (status.IsIncomplete()) {
+    getFallbackAmount(keyHash, args);
+    return simpleStringOk();
+  }
+  if (!status.ok()) {
+    return errorResp(folly::sformat("RocksDB error: {}", status.ToString()));
+  }
+  if (recentKeys_) recentKeys_->touch(key, nowMs());
+  // Without reading the bucket the tokens actually taken are unknown, so peers are told about all of them
+  if (deltaCrdt_) deltaCrdt_->recordLocal(key, args.tokenAmount, nowMs());
+  return simpleStringOk();
+}
+
+codec::RedisValue RateLimitHandler::handleWaitCommand(const std::vector<std::string>& cmd, bool useMs, Context* ctx) {
+  RateLimitArgs args = {};
+  RateLimitOptions options = {};
+  bool strict = false;
+  codec::RedisValue parseStatus = parseRateLimitArgs(cmd, useMs, true, &args, &strict, &options);
+  if (parseStatus != simpleStringOk()) return parseStatus;
+  if (options.leaseTimeMs > 0 || options.leaseId > 0 || options.shards > 0 || strict) {
+    return errorSyntaxError();
+  }
+  if (applyOverrides(cmd[1], &args)) return codec::RedisValue(0L);
+  // waiting up to one refill covers any request no larger than the refill amount
+  if (options.timeoutMs == 0) options.timeoutMs = args.refillTimeMs;
+
+  RedisIntType waitMs;
+  rocksdb::Status status = reserveTokens(cmd[1], args, options.timeoutMs, &waitMs);
+  if (!status.ok()) {
+    return errorResp(folly::sformat("RocksDB error: {}", status.ToString()));
+  }
+  if (waitMs <= 0) return codec::RedisValue(waitMs);
+  // round up so that clients never wake up before their tokens are available
+  int64_t tsMultiplier = useMs ? 1 : 1000;
+  return codec::RedisValue((waitMs + tsMultiplier - 1) / tsMultiplier);
+}
+
+bool RateLimitHandler::applyOverrides(const std::string& keyName, RateLimitHandler::RateLimitArgs* args) const {
+  if (!overrides_) return false;
+  // a missing table (the file was never loaded) means no overrides
+  std::shared_ptr<const RateLimitOverrideTable> table = overrides_->getTable();
+  RateLimitOverrideTable::Entry entry;
+  if (!table || !table->lookup(keyName, &entry)) return false;
+  if (entry.exempt) return true;
+  if (entry.maxAmount > 0) args->maxAmount = entry.maxAmount;
+  if (entry.refillTimeMs > 0) args->refillTimeMs = entry.refillTimeMs;
+  if (entry.refillAmount > 0) args->refillAmount = entry.refillAmount;
+  return false;
+}
+
+void RateLimitHandler::cacheAmount(size_t keyHash, RateLimitHandler::RedisIntType amount,
+                                   RateLimitHandler::RedisIntType refilledAtMs) {
+  // callers hold the mutex of the slot, so there is a single writer at a time
+  CachedAmount& cached = cachedAmounts_[keyHash % kMaxConcurrentWriters];
+  cached.version++;
+  cached.keyHash.store(keyHash);
+  cached.amount.store(amount);
+  cached.refilledAtMs.store(refilledAtMs);
+  cached.version++;
+}
+
+bool RateLimitHandler::getCachedAmount(size_t keyHash, RateLimitHandler::RedisIntType* amount,
+                                       RateLimitHandler::RedisIntType* refilledAtMs) const {
+  const CachedAmount& cached = cachedAmounts_[keyHash % kMaxConcurrentWriters];
+  uint64_t versionBefore = cached.version.load();
+  if (versionBefore % 2 != 0 || cached.keyHash.load() != keyHash) return false;
+  *amount = cached.amount.load();
+  *refilledAtMs = cached.refilledAtMs.load();
+  return cached.version.load() == versionBefore;
+}
+
+RateLimitHandler::RedisIntType RateLimitHandler::getFallbackAmount(size_t keyHash,
+                                                                   const RateLimitHandler::RateLimitArgs& args) {
+  LOG_EVERY_N(WARNING, 1000) << "Requests exceeded the " << deadlineMs_
+                             << "ms deadline, answering with " << FLAGS_ratelimit_deadline_fallback << " fallback";
+  if (deadlineFallback_ == DeadlineFallback::kDeny) {
+    deadlineFallbackCounts_[static_cast<int>(DeadlineFallback::kDeny)]++;
+    return 0;
+  }
+  RedisIntType amount;
+  RedisIntType refilledAtMs;
+  if (deadlineFallback_ == DeadlineFallback::kCached && getCachedAmount(keyHash, &amount, &refilledAtMs)) {
+    deadlineFallbackCounts_[static_cast<int>(DeadlineFallback::kCached)]++;
+    // no tokens are left while in debt
+    return std::max(amount, 0L);
+  }
+  deadlineFallbackCounts_[static_cast<int>(DeadlineFallback::kAllow)]++;
+  return args.maxAmount;
+}
+
+bool RateLimitHandler::parseDeadlineFallback(const std::string& name, RateLimitHandler::DeadlineFallback* fallback) {
+  std::string nameLower = boost::to_lower_copy(name);
+  if (nameLower == "allow") {
+    *fallback = DeadlineFallback::kAllow;
+  } else if (nameLower == "deny") {
+    *fallback = DeadlineFallback::kDeny;
+  } else if (nameLower == "cached") {
+    *fallback = DeadlineFallback::kCached;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+codec::RedisValue RateLimitHandler::rlStatsCommand(const std::vector<std::string>& cmd, Context* ctx) {
+  std::vector<codec::RedisValue> result;
+  result.emplace_back(std::string("deadline_fallback_allow"));
+  result.emplace_back(static_cast<RedisIntType>(getDeadlineFallbackCount(DeadlineFallback::kAllow)));
+  result.emplace_back(std::string("deadline_fallback_deny"));
+  result.emplace_back(static_cast<RedisIntType>(getDeadlineFallbackCount(DeadlineFallback::kDeny)));
+  result.emplace_back(std::string("deadline_fallback_cached"));
+  result.emplace_back(static_cast<RedisIntType>(getDeadlineFallbackCount(DeadlineFallback::kCached)));
+  return codec::RedisValue(std::move(result));
 }
 
 RateLimitHandler::RedisIntType RateLimitHandler::getAdjustedAmountFromDb(
     const std::string& keyName, const RateLimitHandler::RateLimitArgs& args, std::string* keyBuf,
     RateLimitHandler::RedisIntType* newRefilledAtMs, RateLimitHandler::SessionParams* sessionParams) {
   KeyParams keyParams{ args.maxAmount, args.refillAmount, args.refillTimeMs };
-  rocksdb::Slice key = encodeRateLimitKey(keyName, keyParams, keyBuf);
+  rocksdb::Slice key = encodeRateLimitKey(keyName, keyParams, keyBuf, hashKeyNames_);
+  return getAdjustedAmountFromDb(key, args, newRefilledAtMs, sessionParams);
+}
 
+RateLimitHandler::RedisIntType RateLimitHandler::getAdjustedAmountFromDb(
+    const rocksdb::Slice& key, const RateLimitHandler::RateLimitArgs& args,
+    RateLimitHandler::RedisIntType* newRefilledAtMs, RateLimitHandler::SessionParams* sessionParams) {
   std::string encodedValue;
   rocksdb::Status status = db()->Get(rocksdb::ReadOptions(), key, &encodedValue);
+  return adjustStoredAmount(status, encodedValue, args, newRefilledAtMs, sessionParams);
+}
+
+RateLimitHandler::RedisIntType RateLimitHandler::adjustStoredAmount(
+    const rocksdb::Status& status, const std::string& encodedValue, const RateLimitHandler::RateLimitArgs& args,
+    RateLimitHandler::RedisIntType* newRefilledAtMs, RateLimitHandler::SessionParams* sessionParams) {
   if (status.ok()) {
     ValueParams valueParams;
     CHECK(decodeRateLimitValue(encodedValue, &valueParams, sessionParams))
@@ -82,6 +637,158 @@ RateLimitHandler::RedisIntType RateLimitHandler::getAdjustedAmountFromDb(
   }
 }
 
+codec::RedisValue RateLimitHandler::rlMergeCommand(const std::vector<std::string>& cmd, Context* ctx) {
+  if (!deltaCrdt_) return errorResp("Multi-node mode is not enabled on this node");
+  // node id followed by key, epoch and count triples
+  if ((cmd.size() - 2) % 3 != 0) return errorSyntaxError();
+
+  RedisIntType applied = 0;
+  for (size_t i = 2; i < cmd.size(); i += 3) {
+    RateLimitDeltaCrdt::Counter counter{ cmd[i], 0, 0 };
+    try {
+      counter.epochMs = folly::to<RedisIntType>(cmd[i + 1]);
+      counter.count = folly::to<RedisIntType>(cmd[i + 2]);
+    } catch (std::range_error&) {
+      return errorInvalidInteger();
+    }
+    RedisIntType delta = deltaCrdt_->merge(cmd[1], counter, nowMs());
+    if (delta <= 0) continue;
+    rocksdb::Status status = applyRemoteConsumption(cmd[i], delta);
+    if (!status.ok()) {
+      // the error makes the peer resend all its counters, which then applies these tokens again
+      deltaCrdt_->unmerge(cmd[1], counter, delta);
+      return errorResp(folly::sformat("RocksDB error: {}", status.ToString()));
+    }
+    applied += delta;
+  }
+  return codec::RedisValue(applied);
+}
+
+rocksdb::Status RateLimitHandler::applyRemoteConsumption(const std::string& key,
+                                                         RateLimitHandler::RedisIntType tokens) {
+  KeyParams keyParams;
+  if (!decodeRateLimitKey(key, &keyParams) || keyParams.maxAmount < 1 || keyParams.refillAmount < 1 ||
+      keyParams.refillTimeMs < 1) {
+    return rocksdb::Status::InvalidArgument("Malformed rate limit key");
+  }
+  RateLimitArgs args{ keyParams.maxAmount, keyParams.refillTimeMs, keyParams.refillAmount, tokens, nowMs() };
+  RedisIntType applied;
+  return addTokens(key, args, -tokens, &applied);
+}
+
+rocksdb::Status RateLimitHandler::addTokens(const std::string& key, const RateLimitHandler::RateLimitArgs& args,
+                                            RateLimitHandler::RedisIntType delta,
+                                            RateLimitHandler::RedisIntType* applied) {
+  size_t keyHash = std::hash<std::string>()(key);
+  std::unique_lock<std::timed_mutex> lock(mutexes_[keyHash % kMaxConcurrentWriters], std::defer_lock);
+  RedisIntType adjustedAmount;
+  RedisIntType newRefilledAtMs;
+  std::string encodedValue;
+  if (!lockAndReadBucket(key, args, &lock, &adjustedAmount, &newRefilledAtMs, nullptr, &encodedValue)) {
+    // the amount does not matter, the fallback is only counted
+    getFallbackAmount(keyHash, args);
+    return rocksdb::Status::Incomplete("Deadline exceeded");
+  }
+
+  // never take a bucket below zero, nor out of the debt left by reservations
+  RedisIntType newAmount = std::min(args.maxAmount, std::max(adjustedAmount + delta, std::min(adjustedAmount, 0L)));
+  *applied = newAmount - adjustedAmount;
+  ValueParams newValueParams{ newAmount, newRefilledAtMs, nowMs() };
+  std::string valueBuf;
+  encodeRateLimitValue(newValueParams, &valueBuf);
+  // keep session params, if any, untouched
+  if (encodedValue.size() > sizeof(ValueParams)) valueBuf.append(encodedValue, sizeof(ValueParams), std::string::npos);
+  rocksdb::Status status = writeBucket(key, valueBuf);
+  if (status.IsIncomplete()) {
+    getFallbackAmount(keyHash, args);
+    return status;
+  }
+  if (!status.ok()) return status;
+  cacheAmount(keyHash, newAmount, newRefilledAtMs);
+  return rocksdb::Status::OK();
+}
+
+codec::RedisValue RateLimitHandler::handleLeaseCommand(const std::vector<std::string>& cmd, bool useMs,
+                                                       Context* ctx) {
+  RateLimitArgs args = {};
+  RateLimitOptions options = {};
+  bool strict = false;
+  codec::RedisValue parseStatus = parseRateLimitArgs(cmd, useMs, true, &args, &strict, &options);
+  if (parseStatus != simpleStringOk()) return parseStatus;
+  if (options.leaseId > 0 || options.shards > 0 || options.timeoutMs > 0) return errorSyntaxError();
+  // exempt keys get every requested token
+  bool exempt = applyOverrides(cmd[1], &args);
+  // tokens left unused for longer than a refill would have been refilled anyway, so that is the natural default
+  if (options.leaseTimeMs == 0) options.leaseTimeMs = args.refillTimeMs;
+
+  // a lease is a normal reduce, so it drains the bucket the same way when fewer than the requested tokens are left
+  RedisIntType adjustedAmount = args.tokenAmount;
+  bool fellBack = false;
+  if (!exempt) {
+    rocksdb::Status status = reduceTokens(cmd[1], args, strict, nullptr, &adjustedAmount, &fellBack);
+    if (!status.ok()) {
+      return errorResp(folly::sformat("RocksDB error: {}", status.ToString()));
+    }
+  }
+  RedisIntType granted = std::max<RedisIntType>(0, std::min(adjustedAmount, args.tokenAmount));
+  RedisIntType expiresAtMs = args.clientTimeMs + options.leaseTimeMs;
+
+  // tokens of exempt keys and of fallback answers were never taken, so there is nothing to release
+  RedisIntType leaseId = 0;
+  if (!exempt && !fellBack && granted > 0) {
+    KeyParams keyParams{ args.maxAmount, args.refillAmount, args.refillTimeMs };
+    std::string key;
+    encodeRateLimitKey(cmd[1], keyParams, &key, hashKeyNames_);
+    leaseId = addLease(key, granted, expiresAtMs, options.leaseTimeMs);
+  }
+
+  int64_t tsMultiplier = useMs ? 1 : 1000;
+  std::vector<codec::RedisValue> result;
+  result.emplace_back(granted);
+  result.emplace_back(expiresAtMs / tsMultiplier);
+  result.emplace_back(leaseId);
+  return codec::RedisValue(std::move(result));
+}
+
+codec::RedisValue RateLimitHandler::handleReleaseCommand(const std::vector<std::string>& cmd, bool useMs,
+                                                         Context* ctx) {
+  RateLimitArgs args = {};
+  RateLimitOptions options = {};
+  bool strict = false;
+  codec::RedisValue parseStatus = parseRateLimitArgs(cmd, useMs, true, &args, &strict, &options);
+  if (parseStatus != simpleStringOk()) return parseStatus;
+  // TAKE defaults to 1 for reduces, but how many tokens are unused is only known to the client
+  if (options.leaseId == 0 || options.leaseTimeMs > 0 || options.shards > 0 || options.timeoutMs > 0 || strict ||
+      !hasOptionalArg(cmd, "take")) {
+    return errorSyntaxError();
+  }
+  // exempt keys never took any tokens
+  if (args.tokenAmount == 0 || applyOverrides(cmd[1], &args)) return codec::RedisValue(0L);
+
+  // Returned tokens are not taken off the gossiped counters in multi-node mode, peers keep treating them as consumed
+  KeyParams keyParams{ args.maxAmount, args.refillAmount, args.refillTimeMs };
+  std::string key;
+  encodeRateLimitKey(cmd[1], keyParams, &key, hashKeyNames_);
+  // tokens of an expired or unknown lease count as consumed
+  RedisIntType tokens = takeLeasedTokens(options.leaseId, key, args.tokenAmount, args.clientTimeMs);
+  if (tokens == 0) return codec::RedisValue(0L);
+
+  RedisIntType returned;
+  rocksdb::Status status = addTokens(key, args, tokens, &returned);
+  if (!status.ok()) {
+    // nothing was returned, so the lease keeps its tokens unless it expired meanwhile
+    {
+      std::lock_guard<std::mutex> lock(leasesMutex_);
+      auto it = leases_.find(options.leaseId);
+      if (it != leases_.end()) it->second.remaining += tokens;
+    }
+    // a release that missed the deadline returns nothing, and the client may release the tokens again later
+    if (status.IsIncomplete()) return codec::RedisValue(0L);
+    return errorResp(folly::sformat("RocksDB error: {}", status.ToString()));
+  }
+  return codec::RedisValue(returned);
+}
+
 RateLimitHandler::RedisIntType RateLimitHandler::adjustAmount(RateLimitHandler::RedisIntType currAmount,
     RateLimitHandler::RedisIntType lastRefilledAtMs, const RateLimitHandler::RateLimitArgs& args,
     RateLimitHandler::RedisIntType* newRefilledAtMs) {
@@ -92,8 +799,45 @@ RateLimitHandler::RedisIntType RateLimitHandler::adjustAmount(RateLimitHandler::
   return std::min(args.maxAmount, refills * args.refillAmount + currAmount);
 }
 
+RateLimitHandler::RedisIntType RateLimitHandler::addLease(const std::string& key, RedisIntType tokens,
+                                                          RedisIntType expiresAtMs, RedisIntType leaseTimeMs) {
+  RedisIntType now = nowMs();
+  std::lock_guard<std::mutex> lock(leasesMutex_);
+  if (leases_.size() >= leaseSweepSize_) {
+    for (auto it = leases_.begin(); it != leases_.end();) {
+      if (it->second.expiresAtServerMs <= now) {
+        it = leases_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    // sweeping again only after the table doubled keeps the cost amortized constant per lease
+    leaseSweepSize_ = std::max(kMinLeaseSweepSize, 2 * leases_.size());
+  }
+  RedisIntType leaseId = nextLeaseId_++;
+  leases_.emplace(leaseId, Lease{ key, tokens, expiresAtMs, now + leaseTimeMs });
+  return leaseId;
+}
+
+RateLimitHandler::RedisIntType RateLimitHandler::takeLeasedTokens(RedisIntType leaseId, const std::string& key,
+                                                                  RedisIntType tokens, RedisIntType clientTimeMs) {
+  std::lock_guard<std::mutex> lock(leasesMutex_);
+  auto it = leases_.find(leaseId);
+  // a lease id only ever releases into the bucket it was taken from
+  if (it == leases_.end() || it->second.key != key) return 0;
+  if (clientTimeMs >= it->second.expiresAtMs) {
+    leases_.erase(it);
+    return 0;
+  }
+  // fully released leases stay until they expire, so a failed release can give its tokens back
+  RedisIntType taken = std::min(tokens, it->second.remaining);
+  it->second.remaining -= taken;
+  return taken;
+}
+
 codec::RedisValue RateLimitHandler::parseRateLimitArgs(const std::vector<std::string>& cmd, bool useMs, bool isReduce,
-                                                       RateLimitHandler::RateLimitArgs* args, bool* strict) {
+                                                       RateLimitHandler::RateLimitArgs* args, bool* strict,
+                                                       RateLimitHandler::RateLimitOptions* options) {
   // Timestamps are in milliseconds internally, so multiply by 1000 when clients are not using milliseconds
   int64_t tsMultiplier = useMs ? 1 : 1000;
   try {
@@ -128,6 +872,18 @@ codec::RedisValue RateLimitHandler::parseRateLimitArgs(const std::vector<std::st
         args->tokenAmount = value;
       } else if (argLower == "at") {
         args->clientTimeMs = value * tsMultiplier;
+      } else if (options && argLower == "ttl") {
+        if (value < 1) return errorInvalidInteger();
+        options->leaseTimeMs = value * tsMultiplier;
+      } else if (options && argLower == "lease") {
+        if (value < 1) return errorInvalidInteger();
+        options->leaseId = value;
+      } else if (options && argLower == "timeout") {
+        if (value < 1) return errorInvalidInteger();
+        options->timeoutMs = value * tsMultiplier;
+      } else if (options && argLower == "shards") {
+        if (value < 1 || value > kMaxShards) return errorInvalidInteger();
+        options->shards = value;
       } else {
         return errorSyntaxError();
       }
@@ -144,8 +900,16 @@ codec::RedisValue RateLimitHandler::parseRateLimitArgs(const std::vector<std::st
 }
 
 rocksdb::Slice RateLimitHandler::encodeRateLimitKey(const std::string& keyName, const KeyParams& params,
-                                                    std::string* keyBuf) {
-  keyBuf->append(keyName);
+                                                    std::string* keyBuf, bool hashKeyName) {
+  if (hashKeyName) {
+    // collisions are negligible at 128 bits, and the hash is fixed-length just like `KeyParams`
+    uint64_t hash[2] = { 0, 0 };
+    static_assert(sizeof(hash) == kHashedKeyNameSize, "Hashed key name size mismatch");
+    folly::hash::SpookyHashV2::Hash128(keyName.data(), keyName.size(), &hash[0], &hash[1]);
+    keyBuf->append(reinterpret_cast<const char *>(hash), sizeof(hash));
+  } else {
+    keyBuf->append(keyName);
+  }
   // Use fixed-length encoding to avoid conflicts when concatenated with the key name
   keyBuf->append(reinterpret_cast<const char *>(&params), sizeof(params));
   return rocksdb::Slice(*keyBuf);
@@ -174,6 +938,15 @@ bool RateLimitHandler::decodeRateLimitValue(const rocksdb::Slice& encodedValue,
   return true;
 }
 
+bool RateLimitHandler::decodeMergeOperand(const rocksdb::Slice& encodedOperand, RateLimitHandler::MergeParams* params) {
+  if (encodedOperand.size() != sizeof(MergeParams)) return false;
+  std::memcpy(params, encodedOperand.data_, sizeof(MergeParams));
+  return true;
+}
+
 constexpr int RateLimitHandler::kMaxConcurrentWriters;
+constexpr size_t RateLimitHandler::kHashedKeyNameSize;
+constexpr RateLimitHandler::RedisIntType RateLimitHandler::kMaxShards;
+constexpr size_t RateLimitHandler::kMinLeaseSweepSize;
 
 }  // namespace ratelimit
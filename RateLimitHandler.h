@@ -1,6 +1,12 @@
 #ifndef RATELIMIT_RATELIMITHANDLER_H_
 #define RATELIMIT_RATELIMITHANDLER_H_
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -11,6 +17,12 @@
 #include "codec/RedisValue.h"
 #include "pipeline/RedisHandler.h"
 #include "ratelimit/RateLimitCompactionFilter.h"
+#include "ratelimit/RateLimitDeadlineReader.h"
+#include "ratelimit/RateLimitDeltaCrdt.h"
+#include "ratelimit/RateLimitGossiper.h"
+#include "ratelimit/RateLimitMergeOperator.h"
+#include "ratelimit/RateLimitOverrideTable.h"
+#include "ratelimit/RateLimitWarmSnapshot.h"
 #include "rocksdb/db.h"
 #include "rocksdb/slice.h"
 
@@ -45,6 +57,13 @@ class RateLimitHandler : public pipeline::RedisHandler {
     RedisIntType sessionStartedAtMs;
   };
   static_assert(sizeof(SessionParams) == sizeof(RedisIntType) * 1, "Entries in `SessionParams` are not aligned");
+  // Merge operands written by RL.RECORD, each taking tokens at the given time, see `RateLimitMergeOperator`
+  struct MergeParams {
+    RedisIntType tokenAmount;
+    RedisIntType clientTimeMs;
+    RedisIntType serverTimeMs;
+  };
+  static_assert(sizeof(MergeParams) == sizeof(RedisIntType) * 3, "Entries in `MergeParams` are not aligned");
   // Arguments for Redis commands
   struct RateLimitArgs {
     RedisIntType maxAmount;
@@ -54,8 +73,24 @@ class RateLimitHandler : public pipeline::RedisHandler {
     RedisIntType clientTimeMs;
   };
   static_assert(sizeof(RateLimitArgs) == sizeof(RedisIntType) * 5, "Entries in `RateLimitArgs` are not aligned");
+  // Optional arguments that only some Redis commands accept, zero when not provided
+  struct RateLimitOptions {
+    // TTL for RL.LEASE: how long the leased tokens may be used
+    RedisIntType leaseTimeMs;
+    // LEASE for RL.RELEASE: the id RL.LEASE replied with for the lease returning its unused tokens
+    RedisIntType leaseId;
+    // SHARDS for RL.GET and RL.REDUCE: how many sub-buckets a hot bucket is split into
+    RedisIntType shards;
+    // TIMEOUT for RL.WAIT: how long the caller is willing to wait for the tokens
+    RedisIntType timeoutMs;
+  };
+  static constexpr RedisIntType kMaxShards = 256;
 
-  static rocksdb::Slice encodeRateLimitKey(const std::string& keyName, const KeyParams& params, std::string* keyBuf);
+  // Key names are stored verbatim unless `hashKeyName` is set, in which case a fixed-width 128-bit hash of the name
+  // is stored in place of it. Either way `KeyParams` remain the fixed-length suffix of the key.
+  static constexpr size_t kHashedKeyNameSize = 2 * sizeof(uint64_t);
+  static rocksdb::Slice encodeRateLimitKey(const std::string& keyName, const KeyParams& params, std::string* keyBuf,
+                                           bool hashKeyName = false);
   template <typename T>
   static rocksdb::Slice encodeRateLimitValue(const T& params, std::string* valueBuf) {
     valueBuf->append(reinterpret_cast<const char *>(&params), sizeof(params));
@@ -67,49 +102,138 @@ class RateLimitHandler : public pipeline::RedisHandler {
   static bool decodeRateLimitKey(const rocksdb::Slice& encodedKey, KeyParams* params);
   static bool decodeRateLimitValue(const rocksdb::Slice& encodedValue, ValueParams* params,
                                    SessionParams* sessionParams);
+  static bool decodeMergeOperand(const rocksdb::Slice& encodedOperand, MergeParams* params);
 
   // Parse input arguments with default values for optional arguments
+  // Command specific options are only accepted when `options` is provided
   static codec::RedisValue parseRateLimitArgs(const std::vector<std::string>& cmd, bool useMs, bool isReduce,
-                                              RateLimitArgs* args, bool* strict);
+                                              RateLimitArgs* args, bool* strict, RateLimitOptions* options = nullptr);
   static bool getRateLimitArgsDeprecated(const std::vector<std::string>& cmd, RateLimitArgs* args);
 
+  // A sharded bucket is stored as `shards` sub-buckets, each holding its share of the tokens and refills
+  // Returns the arguments and key name of sub-bucket `shard`
+  static RateLimitArgs getShardArgs(const RateLimitArgs& args, RedisIntType shard, RedisIntType shards);
+  static std::string getShardKeyName(const std::string& keyName, RedisIntType shard, RedisIntType shards);
+  // Spread `amount` tokens over the sub-buckets in proportion to their shares of `args.maxAmount`
+  static std::vector<RedisIntType> rebalanceShards(const RateLimitArgs& args, RedisIntType shards, RedisIntType amount);
+
   // Lazily adjust the current token bucket amount based on the given configuration and timestamps
   static RedisIntType adjustAmount(RedisIntType currAmount, RedisIntType lastRefilledAtMs, const RateLimitArgs& args,
                                    RedisIntType* newRefilledAtMs);
+  // Amount left after taking tokens from the adjusted amount. Buckets are drained when there are not enough tokens,
+  // and buckets in debt from reservations stay in debt.
+  static RedisIntType reduceAmount(RedisIntType adjustedAmount, RedisIntType tokenAmount) {
+    return std::max(adjustedAmount - tokenAmount, std::min(adjustedAmount, static_cast<RedisIntType>(0)));
+  }
+  // Whether a bucket left alone for `idleTimeMs` would be full again, starting from `debt` tokens below empty
+  static bool isRefilledAfter(const KeyParams& params, RedisIntType idleTimeMs, RedisIntType debt) {
+    return idleTimeMs / params.refillTimeMs * params.refillAmount >= params.maxAmount + debt;
+  }
 
   static void optimizeColumnFamily(int defaultBlockCacheSizeMb, rocksdb::ColumnFamilyOptions* options) {
     options->OptimizeForPointLookup(defaultBlockCacheSizeMb);
     options->compaction_filter = new RateLimitCompactionFilter();
+    // Operands cannot be combined without the bucket they apply to, so there is no partial merge. Keys that only ever
+    // see RL.RECORD get their operands folded into a full value by compaction. `max_successive_merges` would fold them
+    // on write instead, but it reads the bucket inside the merge, under the lock and without a deadline.
+    options->merge_operator = std::make_shared<RateLimitMergeOperator>();
   }
 
-  explicit RateLimitHandler(std::shared_ptr<pipeline::DatabaseManager> databaseManager)
-      : pipeline::RedisHandler(databaseManager), mutexes_(new std::mutex[kMaxConcurrentWriters]) {}
+  explicit RateLimitHandler(std::shared_ptr<pipeline::DatabaseManager> databaseManager);
+  ~RateLimitHandler() override;
+
+  // Number of keys read from the warm snapshot on startup, see `--ratelimit_warm_snapshot_path`
+  size_t getPreloadedKeyCount() const { return preloadedKeyCount_; }
 
   const CommandHandlerTable& getCommandHandlerTable() const override {
     static const CommandHandlerTable commandHandlerTable(mergeWithDefaultCommandHandlerTable({
-      {"rl.get", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlGetCommand), 3, 8}},
-      {"rl.reduce", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlReduceCommand), 3, 10}},
+      {"rl.get", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlGetCommand), 3, 10}},
+      {"rl.reduce", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlReduceCommand), 3, 12}},
       {"rl.sessionize", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlSessionizeCommand), 3, 10}},
-      {"rl.pget", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlPgetCommand), 3, 8}},
-      {"rl.preduce", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlPreduceCommand), 3, 10}},
+      {"rl.pget", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlPgetCommand), 3, 10}},
+      {"rl.preduce", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlPreduceCommand), 3, 12}},
       {"rl.psessionize", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlPsessionizeCommand), 3, 10}},
+      {"rl.lease", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlLeaseCommand), 3, 12}},
+      {"rl.release", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlReleaseCommand), 3, 12}},
+      {"rl.please", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlPleaseCommand), 3, 12}},
+      {"rl.prelease", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlPreleaseCommand), 3, 12}},
+      {"rl.record", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlRecordCommand), 3, 9}},
+      {"rl.precord", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlPrecordCommand), 3, 9}},
+      {"rl.wait", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlWaitCommand), 3, 11}},
+      {"rl.pwait", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlPwaitCommand), 3, 11}},
+      {"rl.merge", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlMergeCommand), 4,
+                    static_cast<int>(1 + 3 * RateLimitGossiper::kMaxEntriesPerMessage)}},
+      {"rl.stats", {static_cast<CommandHandlerFunc>(&RateLimitHandler::rlStatsCommand), 0, 0}},
     }));
     return commandHandlerTable;
   }
 
   RedisIntType getAdjustedAmountFromDb(const std::string& keyName, const RateLimitArgs& args, std::string* keyBuf,
                                        RedisIntType* newRefilledAtMs, SessionParams* sessionParams);
+  RedisIntType getAdjustedAmountFromDb(const rocksdb::Slice& key, const RateLimitArgs& args,
+                                       RedisIntType* newRefilledAtMs, SessionParams* sessionParams);
+
+  // Take tokens consumed on a peer node out of the local bucket stored under the encoded `key`
+  rocksdb::Status applyRemoteConsumption(const std::string& key, RedisIntType tokens);
+  // Add `delta` tokens (or take them when negative) to the bucket stored under the encoded `key`, keeping the amount
+  // within [0, maxAmount]. Returns how many tokens were actually added (or taken) in `applied`.
+  // Returns `Incomplete` without changing anything when `--ratelimit_deadline_ms` passes first.
+  rocksdb::Status addTokens(const std::string& key, const RateLimitArgs& args, RedisIntType delta,
+                            RedisIntType* applied);
+
+  // What to reply when a request cannot be served within `--ratelimit_deadline_ms`
+  enum class DeadlineFallback {
+    kAllow = 0,   // fail open: report a full bucket
+    kDeny = 1,    // fail closed: report an empty bucket
+    kCached = 2,  // report the amount last seen for the key, or fail open when there is none
+  };
+  static bool parseDeadlineFallback(const std::string& name, DeadlineFallback* fallback);
+
+  uint64_t getDeadlineFallbackCount(DeadlineFallback fallback) const {
+    return deadlineFallbackCounts_[static_cast<int>(fallback)].load(std::memory_order_relaxed);
+  }
+
+ protected:
+  // use hashed key as mutex index to prevent concurrent writes
+  std::timed_mutex& mutexFor(const std::string& key) {
+    return mutexes_[std::hash<std::string>()(key) % kMaxConcurrentWriters];
+  }
 
  private:
   static constexpr int kMaxConcurrentWriters = 1024;
 
+  // Tokens last written per mutex slot, along with the refill mark they were written at. Read without locking when
+  // the slot's mutex cannot be acquired in time, and by sharded reduces summing up the other sub-buckets.
+  // `version` is odd while the entry is updated, so readers can tell a consistent entry from a torn one
+  struct CachedAmount {
+    std::atomic<uint64_t> version;
+    std::atomic<size_t> keyHash;
+    std::atomic<RedisIntType> amount;
+    std::atomic<RedisIntType> refilledAtMs;
+  };
+
   codec::RedisValue handleRlCommand(const std::vector<std::string>& cmd, bool useMs, bool isReduce, bool isSessionize,
                                     Context* ctx) {
     RateLimitArgs args = {};
+    RateLimitOptions options = {};
     bool strict = false;
-    codec::RedisValue parseStatus = parseRateLimitArgs(cmd, useMs, isReduce, &args, &strict);
+    codec::RedisValue parseStatus = parseRateLimitArgs(cmd, useMs, isReduce, &args, &strict, &options);
     if (parseStatus != simpleStringOk()) return parseStatus;
-    if (isSessionize) {
+    if (options.leaseTimeMs > 0 || options.leaseId > 0 || options.timeoutMs > 0 ||
+        (options.shards > 0 && (isSessionize || strict))) {
+      return errorSyntaxError();
+    }
+    // exempt keys are answered from the override table alone, without locking or reading anything
+    if (applyOverrides(cmd[1], &args)) {
+      if (!isSessionize) return codec::RedisValue(args.maxAmount);
+      std::vector<codec::RedisValue> result;
+      result.emplace_back(args.maxAmount);
+      result.emplace_back(args.clientTimeMs);
+      return codec::RedisValue(std::move(result));
+    }
+    if (options.shards > 1) {
+      return getAndReduceShardedTokens(cmd[1], args, options.shards, ctx);
+    } else if (isSessionize) {
       SessionParams sessionParams;
       // By default, each request belongs to its own session, unless rate limit says otherwise
       sessionParams.sessionStartedAtMs = args.clientTimeMs;
@@ -148,12 +272,151 @@ class RateLimitHandler : public pipeline::RedisHandler {
     return handleRlCommand(cmd, true, true, true, ctx);
   }
 
+  // Leases hand out a block of tokens that clients enforce locally until the lease expires
+  // RL.LEASE replies with the granted tokens, the lease expiry in the command's time unit, and the lease id
+  codec::RedisValue handleLeaseCommand(const std::vector<std::string>& cmd, bool useMs, Context* ctx);
+  // RL.RELEASE puts unused tokens of a lease back as long as it has not expired and replies with the tokens returned
+  // A lease never returns more than it was granted, however many times it is released
+  codec::RedisValue handleReleaseCommand(const std::vector<std::string>& cmd, bool useMs, Context* ctx);
+
+  codec::RedisValue rlLeaseCommand(const std::vector<std::string>& cmd, Context* ctx) {
+    return handleLeaseCommand(cmd, false, ctx);
+  }
+  codec::RedisValue rlReleaseCommand(const std::vector<std::string>& cmd, Context* ctx) {
+    return handleReleaseCommand(cmd, false, ctx);
+  }
+  codec::RedisValue rlPleaseCommand(const std::vector<std::string>& cmd, Context* ctx) {
+    return handleLeaseCommand(cmd, true, ctx);
+  }
+  codec::RedisValue rlPreleaseCommand(const std::vector<std::string>& cmd, Context* ctx) {
+    return handleReleaseCommand(cmd, true, ctx);
+  }
+
+  // RL.RECORD takes tokens like RL.REDUCE but without reading the bucket, and always replies OK
+  // The tokens are written as a merge operand that RocksDB folds into the bucket on reads and compactions. The reply
+  // cannot be left out, since Redis clients match replies to commands by their order on the connection.
+  codec::RedisValue handleRecordCommand(const std::vector<std::string>& cmd, bool useMs, Context* ctx);
+
+  codec::RedisValue rlRecordCommand(const std::vector<std::string>& cmd, Context* ctx) {
+    return handleRecordCommand(cmd, false, ctx);
+  }
+  codec::RedisValue rlPrecordCommand(const std::vector<std::string>& cmd, Context* ctx) {
+    return handleRecordCommand(cmd, true, ctx);
+  }
+
+  // RL.WAIT reserves tokens that may only become available after a refill and replies with how long the caller has to
+  // wait before using them, or -1 without reserving anything when that would take longer than the timeout.
+  // Callers sleep exactly once instead of retrying in a loop, and are served in the order they asked.
+  // The reply is not held back until the tokens are available: command handlers reply synchronously, without a request
+  // key to answer later with, and replies on a connection go out in order, so a parked reply would also hold back every
+  // command pipelined behind it on that connection.
+  codec::RedisValue handleWaitCommand(const std::vector<std::string>& cmd, bool useMs, Context* ctx);
+
+  codec::RedisValue rlWaitCommand(const std::vector<std::string>& cmd, Context* ctx) {
+    return handleWaitCommand(cmd, false, ctx);
+  }
+  codec::RedisValue rlPwaitCommand(const std::vector<std::string>& cmd, Context* ctx) {
+    return handleWaitCommand(cmd, true, ctx);
+  }
+
+  // RL.STATS replies with name and value pairs of server counters
+  codec::RedisValue rlStatsCommand(const std::vector<std::string>& cmd, Context* ctx);
+
+  // Multi-node mode: fold token counters gossiped by a peer into local buckets
+  // RL.MERGE nodeId key epoch count [key epoch count ...]
+  codec::RedisValue rlMergeCommand(const std::vector<std::string>& cmd, Context* ctx);
+
   // Get current tokens remaining in the bucket and optionally take the specified amount
   // Note that the returned value is the remaining tokens before taking any
   codec::RedisValue getAndReduceTokens(const std::string& keyName, const RateLimitArgs& args,
                                        bool strict, SessionParams* sessionParams, Context* ctx);
+  // Same as above for a bucket split into sub-buckets, always reporting the total of all sub-buckets. Reduces take from
+  // the calling thread's own sub-bucket while it has enough tokens. Otherwise they lock every sub-bucket, take the
+  // tokens from the total and rebalance the rest, or take nothing when the total is short.
+  // Strict mode is not supported, as no single sub-bucket runs dry when the whole bucket does
+  codec::RedisValue getAndReduceShardedTokens(const std::string& keyName, const RateLimitArgs& args,
+                                              RedisIntType shards, Context* ctx);
+  // Same as above, but leaves the response to the caller
+  // `fellBack` is set when the deadline passed and `adjustedAmount` is a fallback, in which case nothing was taken
+  rocksdb::Status reduceTokens(const std::string& keyName, const RateLimitArgs& args, bool strict,
+                               SessionParams* sessionParams, RedisIntType* adjustedAmount, bool* fellBack = nullptr);
+  // Take tokens that become available within `timeoutMs`, letting the bucket go into debt until they are refilled
+  // Returns how long the caller has to wait in `waitMs`, or -1 when nothing was taken
+  rocksdb::Status reserveTokens(const std::string& keyName, const RateLimitArgs& args, RedisIntType timeoutMs,
+                                RedisIntType* waitMs);
+
+  // Replace the configuration in `args` with the override of the longest matching prefix of `keyName`, if any
+  // Returns true when the key is exempt from rate limiting, in which case `args` is left untouched
+  bool applyOverrides(const std::string& keyName, RateLimitArgs* args) const;
 
-  std::unique_ptr<std::mutex[]> mutexes_;
+  // Lock the bucket stored under the encoded `key` and read it, waiting at most `--ratelimit_deadline_ms` for both
+  // Returns false when the deadline passed, in which case the caller answers with `getFallbackAmount`
+  // The stored value is left in `encodedValue` if provided, or emptied when there is none
+  bool lockAndReadBucket(const std::string& key, const RateLimitArgs& args, std::unique_lock<std::timed_mutex>* lock,
+                         RedisIntType* adjustedAmount, RedisIntType* newRefilledAtMs, SessionParams* sessionParams,
+                         std::string* encodedValue = nullptr);
+  // Lock a bucket, or return false when `deadline` passes first
+  bool lockBucket(std::unique_lock<std::timed_mutex>* lock, std::chrono::steady_clock::time_point deadline);
+  // Read the bucket stored under the encoded `key` without locking it, or return false when `deadline` passes first
+  bool readBucket(const std::string& key, const RateLimitArgs& args, std::chrono::steady_clock::time_point deadline,
+                  RedisIntType* adjustedAmount, RedisIntType* newRefilledAtMs, SessionParams* sessionParams,
+                  std::string* encodedValue = nullptr);
+  // Write the bucket stored under the encoded `key`, returning `Incomplete` instead of stalling under a deadline
+  rocksdb::Status writeBucket(const std::string& key, const rocksdb::Slice& value);
+  // Refilled amount of a bucket read with `status` and `encodedValue`
+  RedisIntType adjustStoredAmount(const rocksdb::Status& status, const std::string& encodedValue,
+                                  const RateLimitArgs& args, RedisIntType* newRefilledAtMs,
+                                  SessionParams* sessionParams);
+
+  // Remember the amount of a bucket just read or written, while holding the mutex of its slot
+  void cacheAmount(size_t keyHash, RedisIntType amount, RedisIntType refilledAtMs);
+  // Read the amount last cached for a bucket, or return false when the slot holds another bucket or is being updated
+  bool getCachedAmount(size_t keyHash, RedisIntType* amount, RedisIntType* refilledAtMs) const;
+  // Count the fallback and return the amount to report in place of the real one
+  RedisIntType getFallbackAmount(size_t keyHash, const RateLimitArgs& args);
+
+  // Remember a lease of `tokens` taken from `key` and return its id
+  RedisIntType addLease(const std::string& key, RedisIntType tokens, RedisIntType expiresAtMs,
+                        RedisIntType leaseTimeMs);
+  // Take up to `tokens` still unreleased from a lease of `key` that has not expired at `clientTimeMs`
+  RedisIntType takeLeasedTokens(RedisIntType leaseId, const std::string& key, RedisIntType tokens,
+                                RedisIntType clientTimeMs);
+
+  std::unique_ptr<std::timed_mutex[]> mutexes_;
+  std::unique_ptr<CachedAmount[]> cachedAmounts_;
+  // See `--ratelimit_deadline_ms`
+  const int deadlineMs_;
+  DeadlineFallback deadlineFallback_;
+  std::array<std::atomic<uint64_t>, 3> deadlineFallbackCounts_;
+  // Only set when there is a deadline
+  std::unique_ptr<RateLimitDeadlineReader> deadlineReader_;
+  // Only set in multi-node mode, see `--ratelimit_node_id`
+  std::unique_ptr<RateLimitDeltaCrdt> deltaCrdt_;
+  // See `--ratelimit_hash_key_names`
+  const bool hashKeyNames_;
+  size_t preloadedKeyCount_ = 0;
+  // Only set when `--ratelimit_warm_snapshot_path` is, keys reduced since startup that go into the warm snapshot
+  std::unique_ptr<RateLimitRecentKeys> recentKeys_;
+  std::unique_ptr<RateLimitGossiper> gossiper_;
+  // Only set when `--ratelimit_overrides_path` is
+  std::unique_ptr<RateLimitOverrideReloader> overrides_;
+
+  // Leases are kept in memory only, so releases after a restart return nothing
+  struct Lease {
+    std::string key;
+    // tokens granted and not released yet
+    RedisIntType remaining;
+    // client time the lease expires at, which releases are checked against
+    RedisIntType expiresAtMs;
+    // server time the lease expires at, after which it is dropped
+    RedisIntType expiresAtServerMs;
+  };
+  static constexpr size_t kMinLeaseSweepSize = 1024;
+  std::mutex leasesMutex_;
+  std::unordered_map<RedisIntType, Lease> leases_;
+  RedisIntType nextLeaseId_;
+  // expired leases are dropped once the table grows past this size, which then doubles the size left
+  size_t leaseSweepSize_ = kMinLeaseSweepSize;
 };
 
 }  // namespace ratelimit
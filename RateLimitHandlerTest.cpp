@@ -1,28 +1,129 @@
+#include <arpa/inet.h>
+#include <ftw.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <memory>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "codec/RedisMessage.h"
+#include "folly/Conv.h"
+#include "folly/Format.h"
 #include "folly/String.h"
+#include "folly/futures/Future.h"
 #include "gmock/gmock.h"
+#include "gflags/gflags.h"
 #include "gtest/gtest.h"
 #include "ratelimit/RateLimitCompactionFilter.h"
+#include "ratelimit/RateLimitDeadlineReader.h"
+#include "ratelimit/RateLimitDeltaCrdt.h"
+#include "ratelimit/RateLimitGossiper.h"
 #include "ratelimit/RateLimitHandler.h"
+#include "ratelimit/RateLimitMergeOperator.h"
+#include "ratelimit/RateLimitOverrideTable.h"
+#include "ratelimit/RateLimitWarmSnapshot.h"
 #include "rocksdb/db.h"
 #include "stesting/TestWithRocksDb.h"
 #include "wangle/channel/Handler.h"
 
+DECLARE_int32(ratelimit_deadline_ms);
+DECLARE_string(ratelimit_deadline_fallback);
+DECLARE_bool(ratelimit_hash_key_names);
+DECLARE_string(ratelimit_node_id);
+DECLARE_string(ratelimit_overrides_path);
+DECLARE_int32(ratelimit_overrides_reload_ms);
+DECLARE_string(ratelimit_warm_snapshot_path);
+
 namespace ratelimit {
 
 class RateLimitHandlerTest : public stesting::TestWithRocksDb {
  protected:
   RateLimitHandlerTest() : stesting::TestWithRocksDb({}, { {"default", RateLimitHandler::optimizeColumnFamily}}) {}
+  ~RateLimitHandlerTest() override {
+    if (!tempDir_.empty()) ::nftw(tempDir_.c_str(), removePath, 16, FTW_DEPTH | FTW_PHYS);
+  }
+
+  // Directory for the files of the current test, removed with everything in it once the test is done
+  const std::string& tempDir() {
+    if (tempDir_.empty()) {
+      const char* root = std::getenv("TEST_TMPDIR");
+      std::string pattern = folly::sformat("{}/ratelimit-XXXXXX", root ? root : "/tmp");
+      EXPECT_NE(nullptr, ::mkdtemp(&pattern[0]));
+      tempDir_ = pattern;
+    }
+    return tempDir_;
+  }
 
   // Ratelimit does not support async command handling, so use default key
   codec::RedisMessage getRedisMessage(codec::RedisValue&& val) {
     return codec::RedisMessage(std::move(val));
   }
+
+  // Compile `entries` into a new file that replaces `path`, the same way ratelimit_override_compiler does
+  void writeOverrideTable(const std::vector<RateLimitOverrideTable::Entry>& entries, const std::string& path) {
+    std::string table;
+    ASSERT_TRUE(RateLimitOverrideTable::compile(entries, &table).ok());
+    std::string tmpPath = path + ".tmp";
+    std::ofstream(tmpPath, std::ios::binary | std::ios::trunc).write(table.data(), table.size());
+    ASSERT_EQ(0, std::rename(tmpPath.c_str(), path.c_str()));
+  }
+
+  // Decode one command of bulk strings in Redis protocol from the start of `buf`
+  // Returns how many bytes it took, or 0 when `buf` does not hold a whole command yet
+  static size_t decodeCommand(const std::string& buf, std::vector<std::string>* cmd) {
+    cmd->clear();
+    size_t offset = 0;
+    auto readHeader = [&](char type, size_t* value) {
+      size_t end = buf.find("\r\n", offset);
+      if (end == std::string::npos || buf[offset] != type) return false;
+      *value = folly::to<size_t>(buf.substr(offset + 1, end - offset - 1));
+      offset = end + 2;
+      return true;
+    };
+    size_t count;
+    if (!readHeader('*', &count)) return 0;
+    for (size_t i = 0; i < count; i++) {
+      size_t size;
+      if (!readHeader('$', &size) || offset + size + 2 > buf.size()) return 0;
+      cmd->push_back(buf.substr(offset, size));
+      offset += size + 2;
+    }
+    return offset;
+  }
+
+  // Receive the next command sent over `fd`, or an empty one when the connection is closed or times out
+  static std::vector<std::string> receiveCommand(int fd) {
+    std::string buf;
+    std::vector<std::string> cmd;
+    char chunk[4096];
+    while (decodeCommand(buf, &cmd) == 0) {
+      ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+      if (n <= 0) return {};
+      buf.append(chunk, n);
+    }
+    return cmd;
+  }
+
+  // tests may change flags freely, they are restored after each test
+  gflags::FlagSaver flagSaver_;
+
+ private:
+  static int removePath(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    return std::remove(path);
+  }
+
+  std::string tempDir_;
 };
 
 class MockRateLimitHandler : public RateLimitHandler {
@@ -36,6 +137,22 @@ class MockRateLimitHandler : public RateLimitHandler {
   bool handleCommand(const std::string& cmdNameLower, const std::vector<std::string>& cmd, Context* ctx) {
     return RateLimitHandler::handleCommand(0L, cmdNameLower, cmd, ctx);
   }
+
+  // Expect an RL.LEASE reply granting `granted` tokens until `expiresAt`, and store its lease id in `leaseId`
+  // Lease ids are only known from the replies, so the id is taken from there before checking the whole reply
+  void expectLease(RedisIntType granted, RedisIntType expiresAt, RedisIntType* leaseId) {
+    auto checkReply = [=](Context* ctx, codec::RedisMessage reply) {
+      *leaseId = reply.val.getArray().back().getInt();
+      std::vector<codec::RedisValue> result = {codec::RedisValue(granted), codec::RedisValue(expiresAt),
+                                               codec::RedisValue(*leaseId)};
+      EXPECT_EQ(codec::RedisMessage(codec::RedisValue(std::move(result))), reply);
+      return folly::makeFuture();
+    };
+    EXPECT_CALL(*this, write(nullptr, testing::_)).WillOnce(testing::Invoke(checkReply));
+  }
+
+  using RateLimitHandler::db;
+  using RateLimitHandler::mutexFor;
 };
 
 TEST_F(RateLimitHandlerTest, EncodeDecodeRateLimitKey) {
@@ -53,6 +170,26 @@ TEST_F(RateLimitHandlerTest, EncodeDecodeRateLimitKey) {
   EXPECT_EQ(inputKeyParams.refillTimeMs, outputKeyParams.refillTimeMs);
 }
 
+TEST_F(RateLimitHandlerTest, EncodeDecodeHashedRateLimitKey) {
+  RateLimitHandler::KeyParams inputKeyParams{ 100, 5, 20 };
+  std::string shortKey;
+  RateLimitHandler::encodeRateLimitKey("abc", inputKeyParams, &shortKey, true);
+  EXPECT_EQ(RateLimitHandler::kHashedKeyNameSize + 3 * sizeof(RateLimitHandler::RedisIntType), shortKey.size());
+  std::string longKey;
+  RateLimitHandler::encodeRateLimitKey(std::string(200, 'x'), inputKeyParams, &longKey, true);
+  EXPECT_EQ(shortKey.size(), longKey.size());
+  EXPECT_NE(shortKey, longKey);
+  std::string sameKey;
+  RateLimitHandler::encodeRateLimitKey("abc", inputKeyParams, &sameKey, true);
+  EXPECT_EQ(shortKey, sameKey);
+
+  RateLimitHandler::KeyParams outputKeyParams;
+  ASSERT_TRUE(RateLimitHandler::decodeRateLimitKey(longKey, &outputKeyParams));
+  EXPECT_EQ(inputKeyParams.maxAmount, outputKeyParams.maxAmount);
+  EXPECT_EQ(inputKeyParams.refillAmount, outputKeyParams.refillAmount);
+  EXPECT_EQ(inputKeyParams.refillTimeMs, outputKeyParams.refillTimeMs);
+}
+
 TEST_F(RateLimitHandlerTest, EncodeDecodeRateLimitValue) {
   RateLimitHandler::ValueParams inputValueParams{ 100, 10000, nowMs() };
   std::string value;
@@ -122,6 +259,63 @@ TEST_F(RateLimitHandlerTest, RateLimitCompactionFilterFalse) {
   EXPECT_FALSE(valueChanged);
 }
 
+TEST_F(RateLimitHandlerTest, RateLimitCompactionFilterInDebt) {
+  RateLimitCompactionFilter filter;
+  std::string newValue;
+  bool valueChanged;
+
+  std::string keyName = "abc";
+  // refill to max after 20 minutes, but paying back the debt takes another 20 minutes
+  RateLimitHandler::KeyParams keyParams{ 100, 5, 60000 };
+  std::string key;
+  RateLimitHandler::encodeRateLimitKey(keyName, keyParams, &key);
+  RateLimitHandler::ValueParams valueParams{ -100, 10000, nowMs() - 1800 * 1000 };  // accessed 30 minutes ago
+  std::string value;
+  RateLimitHandler::encodeRateLimitValue(valueParams, &value);
+
+  EXPECT_FALSE(filter.Filter(0, key, value, &newValue, &valueChanged));
+  EXPECT_FALSE(valueChanged);
+}
+
+TEST_F(RateLimitHandlerTest, RateLimitMergeOperator) {
+  RateLimitMergeOperator mergeOperator;
+  std::string key;
+  RateLimitHandler::encodeRateLimitKey("abc", { 10, 5, 60000 }, &key);
+  std::string operand1;
+  RateLimitHandler::encodeRateLimitValue(RateLimitHandler::MergeParams{ 4, 1000, 1000 }, &operand1);
+  std::string operand2;
+  RateLimitHandler::encodeRateLimitValue(RateLimitHandler::MergeParams{ 8, 2000, 2000 }, &operand2);
+  // refilled by 5 before this one
+  std::string operand3;
+  RateLimitHandler::encodeRateLimitValue(RateLimitHandler::MergeParams{ 2, 62000, 62000 }, &operand3);
+  std::vector<rocksdb::Slice> operands = { operand1, operand2, operand3 };
+
+  // without an existing value, the bucket starts full
+  std::string newValue;
+  rocksdb::Slice existingOperand;
+  rocksdb::MergeOperator::MergeOperationOutput mergeOut(newValue, existingOperand);
+  ASSERT_TRUE(mergeOperator.FullMergeV2(
+      rocksdb::MergeOperator::MergeOperationInput(key, nullptr, operands, nullptr), &mergeOut));
+  RateLimitHandler::ValueParams valueParams;
+  ASSERT_TRUE(RateLimitHandler::decodeRateLimitValue(newValue, &valueParams, nullptr));
+  EXPECT_EQ(3, valueParams.amount);
+  EXPECT_EQ(61000, valueParams.lastRefilledAtMs);
+  EXPECT_EQ(62000, valueParams.lastReducedAtMs);
+
+  // session params of an existing value are kept
+  std::string existingValue;
+  RateLimitHandler::encodeRateLimitValue(RateLimitHandler::ValueParams{ 6, 0, 0 }, &existingValue);
+  RateLimitHandler::encodeRateLimitValue(RateLimitHandler::SessionParams{ 15 }, &existingValue);
+  rocksdb::Slice existingSlice(existingValue);
+  operands = { operand1 };
+  ASSERT_TRUE(mergeOperator.FullMergeV2(
+      rocksdb::MergeOperator::MergeOperationInput(key, &existingSlice, operands, nullptr), &mergeOut));
+  RateLimitHandler::SessionParams sessionParams;
+  ASSERT_TRUE(RateLimitHandler::decodeRateLimitValue(newValue, &valueParams, &sessionParams));
+  EXPECT_EQ(2, valueParams.amount);
+  EXPECT_EQ(15, sessionParams.sessionStartedAtMs);
+}
+
 TEST_F(RateLimitHandlerTest, AdjustAmount) {
   RateLimitHandler::RedisIntType newRefilledAtMs;
   RateLimitHandler::RedisIntType lastRefilledAtMs = 2000;
@@ -431,4 +625,899 @@ TEST_F(RateLimitHandlerTest, SessionizeCommands) {
   EXPECT_TRUE(handler.handleCommand("rl.sessionize", cmd, nullptr));
 }
 
+TEST_F(RateLimitHandlerTest, DeltaCrdtMerge) {
+  std::string key;
+  RateLimitHandler::encodeRateLimitKey("k", { 10, 10, 60 * 1000 }, &key);
+  RateLimitDeltaCrdt crdt("local@1000", 1000);
+  crdt.recordLocal(key, 3, 2000);
+  crdt.recordLocal(key, 2, 2500);
+
+  EXPECT_EQ(5, crdt.merge("peer@1000", { key, 1500, 5 }, 3000));
+  // duplicated and stale counters are no-ops
+  EXPECT_EQ(0, crdt.merge("peer@1000", { key, 1500, 5 }, 3000));
+  EXPECT_EQ(0, crdt.merge("peer@1000", { key, 1500, 4 }, 3000));
+  EXPECT_EQ(2, crdt.merge("peer@1000", { key, 1500, 7 }, 3000));
+  // tokens that could not be applied come back when the peer sends its counter again, also after it grew meanwhile
+  crdt.unmerge("peer@1000", { key, 1500, 7 }, 2);
+  EXPECT_EQ(2, crdt.merge("peer@1000", { key, 1500, 7 }, 3000));
+  EXPECT_EQ(1, crdt.merge("peer@1000", { key, 1500, 8 }, 3000));
+  crdt.unmerge("peer@1000", { key, 1500, 7 }, 2);
+  EXPECT_EQ(2, crdt.merge("peer@1000", { key, 1500, 8 }, 3000));
+  // our own counter echoed back is ignored
+  EXPECT_EQ(0, crdt.merge("local@1000", { key, 2000, 100 }, 3000));
+  // a new run, started after the peer pruned the previous one, counts in full
+  EXPECT_EQ(1, crdt.merge("peer@1000", { key, 90000, 1 }, 90000));
+  EXPECT_EQ(0, crdt.merge("peer@1000", { key, 1500, 9 }, 90000));
+
+  RateLimitDeltaCrdt::Counters dirty = crdt.takeDirtyCounters();
+  ASSERT_EQ(1u, dirty.size());
+  EXPECT_EQ(key, dirty[0].key);
+  EXPECT_EQ(2000, dirty[0].epochMs);
+  EXPECT_EQ(5, dirty[0].count);
+  EXPECT_TRUE(crdt.takeDirtyCounters().empty());
+  EXPECT_EQ(1u, crdt.localCounters().size());
+}
+
+TEST_F(RateLimitHandlerTest, DeltaCrdtRestart) {
+  std::string key;
+  RateLimitHandler::encodeRateLimitKey("k", { 10, 10, 60 * 1000 }, &key);
+  std::string otherKey;
+  RateLimitHandler::encodeRateLimitKey("o", { 10, 10, 60 * 1000 }, &otherKey);
+
+  // this node restarted at 5000, and its buckets may already hold what the peer consumed before that
+  RateLimitDeltaCrdt crdt("local@5000", 5000);
+  EXPECT_EQ(0, crdt.merge("peer@1000", { key, 2000, 8 }, 5100));
+  // only what the peer consumes afterwards is applied
+  EXPECT_EQ(2, crdt.merge("peer@1000", { key, 2000, 10 }, 5200));
+  // counters that started after this node are applied in full
+  EXPECT_EQ(3, crdt.merge("peer@1000", { otherKey, 5050, 3 }, 5200));
+
+  // a restarted peer supersedes its previous incarnation, which is forgotten
+  EXPECT_EQ(4, crdt.merge("peer@6000", { key, 6000, 4 }, 6100));
+  EXPECT_EQ(0, crdt.merge("peer@1000", { key, 2000, 20 }, 6200));
+  // and so does this node
+  EXPECT_EQ(0, crdt.merge("local@1000", { key, 2000, 20 }, 6200));
+}
+
+TEST_F(RateLimitHandlerTest, DeltaCrdtPrune) {
+  std::string key;
+  RateLimitHandler::encodeRateLimitKey("k", { 10, 5, 60 * 1000 }, &key);
+  RateLimitDeltaCrdt crdt("local@0", 0);
+  crdt.recordLocal(key, 3, 1000);
+  EXPECT_EQ(2, crdt.merge("peer@0", { key, 1000, 2 }, 1000));
+
+  // the bucket takes two refills to be full again
+  EXPECT_EQ(0u, crdt.prune(1000 + 2 * 60 * 1000 - 1));
+  // but the local counter has not been gossiped yet, so only the peer counter goes
+  EXPECT_EQ(1u, crdt.prune(1000 + 2 * 60 * 1000));
+  crdt.takeDirtyCounters();
+  EXPECT_EQ(1u, crdt.prune(1000 + 2 * 60 * 1000));
+  EXPECT_TRUE(crdt.localCounters().empty());
+
+  // the next consumption starts a new run
+  crdt.recordLocal(key, 1, 200000);
+  RateLimitDeltaCrdt::Counters counters = crdt.localCounters();
+  ASSERT_EQ(1u, counters.size());
+  EXPECT_EQ(200000, counters[0].epochMs);
+  EXPECT_EQ(1, counters[0].count);
+  // and a pruned peer run sent again is not applied twice
+  EXPECT_EQ(0, crdt.merge("peer@0", { key, 1000, 2 }, 200000));
+}
+
+TEST_F(RateLimitHandlerTest, MergeCommand) {
+  FLAGS_ratelimit_node_id = "local";
+  MockRateLimitHandler handler(databaseManager());
+  FLAGS_ratelimit_node_id = "";
+
+  std::string key;
+  RateLimitHandler::encodeRateLimitKey("a", { 10, 10, 3600 * 1000 }, &key);
+  std::string epoch = folly::to<std::string>(nowMs());
+  std::vector<std::string> cmd = { "rl.merge", "peer@1", key, epoch, "4" };
+  // peer consumed 4 tokens
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(4)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.merge", cmd, nullptr));
+
+  // the same counter again changes nothing
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.merge", cmd, nullptr));
+
+  // local bucket accounts for remote consumption
+  cmd.clear();
+  folly::split(" ", "rl.get a 10 3600", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(6)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.get", cmd, nullptr));
+
+  // A full sync after this node restarted carries counters from before the restart, which the persisted bucket
+  // already accounts for
+  FLAGS_ratelimit_node_id = "local";
+  MockRateLimitHandler restartedHandler(databaseManager());
+  FLAGS_ratelimit_node_id = "";
+  cmd = { "rl.merge", "peer@1", key, "1", "4" };
+  EXPECT_CALL(restartedHandler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+  EXPECT_TRUE(restartedHandler.handleCommand("rl.merge", cmd, nullptr));
+  cmd.clear();
+  folly::split(" ", "rl.get a 10 3600", cmd);
+  EXPECT_CALL(restartedHandler, write(nullptr, getRedisMessage(codec::RedisValue(6)))).Times(1);
+  EXPECT_TRUE(restartedHandler.handleCommand("rl.get", cmd, nullptr));
+
+  cmd = { "rl.merge", "peer@1", key, "1", "4", key };
+  EXPECT_CALL(restartedHandler, write(nullptr, getRedisMessage(RateLimitHandler::errorSyntaxError()))).Times(1);
+  EXPECT_TRUE(restartedHandler.handleCommand("rl.merge", cmd, nullptr));
+}
+
+TEST_F(RateLimitHandlerTest, GossipMergeCommands) {
+  FLAGS_ratelimit_node_id = "local";
+  MockRateLimitHandler handler(databaseManager());
+
+  // more counters than fit in one message, under binary keys that only bulk strings carry as is
+  RateLimitHandler::RedisIntType epochMs = nowMs();
+  RateLimitDeltaCrdt::Counters counters;
+  for (size_t i = 0; i <= RateLimitGossiper::kMaxEntriesPerMessage; i++) {
+    std::string key;
+    RateLimitHandler::encodeRateLimitKey(folly::sformat("k{}", i), { 10, 10, 3600 * 1000 }, &key);
+    counters.push_back({ key, epochMs, static_cast<RateLimitHandler::RedisIntType>(1 + i % 3) });
+  }
+  std::vector<std::string> messages;
+  RateLimitGossiper::encodeMergeCommands("peer@1", counters, &messages);
+  ASSERT_EQ(2u, messages.size());
+
+  // every message decodes back into the counters it holds, the first one as many as fit, which RL.MERGE applies
+  size_t next = 0;
+  for (const auto& message : messages) {
+    std::vector<std::string> cmd;
+    EXPECT_EQ(message.size(), decodeCommand(message, &cmd));
+    EXPECT_EQ(2 + 3 * (next == 0 ? RateLimitGossiper::kMaxEntriesPerMessage : 1), cmd.size());
+    ASSERT_GE(cmd.size(), 2u);
+    EXPECT_EQ("RL.MERGE", cmd[0]);
+    EXPECT_EQ("peer@1", cmd[1]);
+    EXPECT_EQ(0u, (cmd.size() - 2) % 3);
+    RateLimitHandler::RedisIntType total = 0;
+    for (size_t i = 2; i + 2 < cmd.size(); i += 3, next++) {
+      EXPECT_EQ(counters[next].key, cmd[i]);
+      EXPECT_EQ(folly::to<std::string>(epochMs), cmd[i + 1]);
+      EXPECT_EQ(folly::to<std::string>(counters[next].count), cmd[i + 2]);
+      total += counters[next].count;
+    }
+    EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(total)))).Times(1);
+    EXPECT_TRUE(handler.handleCommand("rl.merge", cmd, nullptr));
+  }
+  EXPECT_EQ(counters.size(), next);
+
+  std::vector<std::string> cmd;
+  folly::split(" ", folly::sformat("rl.get k{} 10 3600", RateLimitGossiper::kMaxEntriesPerMessage), cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(10 - counters.back().count)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.get", cmd, nullptr));
+}
+
+TEST_F(RateLimitHandlerTest, GossiperPeerReplies) {
+  int listenFd = ::socket(AF_INET, SOCK_STREAM, 0);
+  ASSERT_GE(listenFd, 0);
+  struct sockaddr_in addr = {};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addrSize = sizeof(addr);
+  ASSERT_EQ(0, ::bind(listenFd, reinterpret_cast<struct sockaddr*>(&addr), addrSize));
+  ASSERT_EQ(0, ::listen(listenFd, 1));
+  ASSERT_EQ(0, ::getsockname(listenFd, reinterpret_cast<struct sockaddr*>(&addr), &addrSize));
+  // never hang the test on a gossiper that does not show up
+  struct timeval timeout = { 10, 0 };
+  ::setsockopt(listenFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  auto accept = [&] {
+    int fd = ::accept(listenFd, nullptr, nullptr);
+    if (fd >= 0) ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+  };
+  auto reply = [](int fd, const std::string& line) {
+    return ::send(fd, line.data(), line.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(line.size());
+  };
+  // keys of the counters in a command, ignoring their order
+  auto keysOf = [](const std::vector<std::string>& cmd) {
+    std::vector<std::string> keys;
+    for (size_t i = 2; i < cmd.size(); i += 3) keys.push_back(cmd[i]);
+    std::sort(keys.begin(), keys.end());
+    return keys;
+  };
+
+  std::string key;
+  RateLimitHandler::encodeRateLimitKey("a", { 10, 10, 3600 * 1000 }, &key);
+  std::string otherKey;
+  RateLimitHandler::encodeRateLimitKey("b", { 10, 10, 3600 * 1000 }, &otherKey);
+  std::vector<std::string> bothKeys = { key, otherKey };
+  std::sort(bothKeys.begin(), bothKeys.end());
+  RateLimitHandler::RedisIntType epochMs = nowMs();
+  std::string epoch = folly::to<std::string>(epochMs);
+
+  RateLimitDeltaCrdt crdt("local@1", 1);
+  crdt.recordLocal(key, 3, epochMs);
+  // the peer replies well within the interval, which is also the socket timeout
+  RateLimitGossiper gossiper(&crdt, { folly::sformat("127.0.0.1:{}", ntohs(addr.sin_port)) }, 200);
+  int fd = accept();
+  ASSERT_GE(fd, 0);
+
+  // a new peer gets every counter
+  EXPECT_EQ((std::vector<std::string>{ "RL.MERGE", "local@1", key, epoch, "3" }), receiveCommand(fd));
+  // and keeps getting all of them while it replies with errors
+  crdt.recordLocal(otherKey, 2, epochMs);
+  ASSERT_TRUE(reply(fd, "-ERR RocksDB error: IO error\r\n"));
+  std::vector<std::string> cmd = receiveCommand(fd);
+  EXPECT_EQ(bothKeys, keysOf(cmd));
+  ASSERT_TRUE(reply(fd, ":2\r\n"));
+
+  // once in sync, only changed counters are sent
+  crdt.recordLocal(key, 1, epochMs);
+  EXPECT_EQ((std::vector<std::string>{ "RL.MERGE", "local@1", key, epoch, "4" }), receiveCommand(fd));
+  ASSERT_TRUE(reply(fd, ":1\r\n"));
+
+  // a peer that dropped the connection gets every counter again after reconnecting
+  ::close(fd);
+  crdt.recordLocal(otherKey, 1, epochMs);
+  fd = accept();
+  ASSERT_GE(fd, 0);
+  cmd = receiveCommand(fd);
+  EXPECT_EQ(bothKeys, keysOf(cmd));
+  EXPECT_EQ(8u, cmd.size());
+  ASSERT_TRUE(reply(fd, ":0\r\n"));
+  ::close(fd);
+  ::close(listenFd);
+}
+
+TEST_F(RateLimitHandlerTest, LeaseReleaseCommands) {
+  MockRateLimitHandler handler(databaseManager());
+  std::vector<std::string> cmd;
+
+  // lease expires after one refill time by default
+  RateLimitHandler::RedisIntType leaseId1 = 0;
+  handler.expectLease(4, 160, &leaseId1);
+  folly::split(" ", "rl.lease a 10 60 take 4 at 100", cmd);
+  EXPECT_TRUE(handler.handleCommand("rl.lease", cmd, nullptr));
+  EXPECT_GT(leaseId1, 0);
+
+  // only the remaining tokens are granted
+  cmd.clear();
+  RateLimitHandler::RedisIntType leaseId2 = 0;
+  handler.expectLease(6, 130, &leaseId2);
+  folly::split(" ", "rl.lease a 10 60 take 8 at 100 ttl 30", cmd);
+  EXPECT_TRUE(handler.handleCommand("rl.lease", cmd, nullptr));
+  EXPECT_GT(leaseId2, 0);
+  EXPECT_NE(leaseId1, leaseId2);
+
+  // nothing left to grant, so there is no lease either
+  cmd.clear();
+  std::vector<codec::RedisValue> result3 = {codec::RedisValue(0), codec::RedisValue(160), codec::RedisValue(0)};
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(std::move(result3))))).Times(1);
+  folly::split(" ", "rl.lease a 10 60 take 1 at 100", cmd);
+  EXPECT_TRUE(handler.handleCommand("rl.lease", cmd, nullptr));
+
+  // return unused tokens before the lease expires
+  cmd.clear();
+  folly::split(" ", folly::sformat("rl.release a 10 60 take 3 lease {} at 120", leaseId2), cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(3)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.release", cmd, nullptr));
+
+  cmd.clear();
+  folly::split(" ", "rl.pget a 10 60000 at 120000", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(3)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.pget", cmd, nullptr));
+
+  // a lease never returns more than it was granted
+  cmd.clear();
+  folly::split(" ", folly::sformat("rl.release a 10 60 take 6 lease {} at 120", leaseId2), cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(3)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.release", cmd, nullptr));
+
+  cmd.clear();
+  folly::split(" ", folly::sformat("rl.release a 10 60 take 6 lease {} at 120", leaseId2), cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.release", cmd, nullptr));
+
+  cmd.clear();
+  folly::split(" ", "rl.pget a 10 60000 at 120000", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(6)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.pget", cmd, nullptr));
+
+  // leases only release into the bucket they were taken from
+  cmd.clear();
+  folly::split(" ", folly::sformat("rl.release b 10 60 take 2 lease {} at 120", leaseId1), cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.release", cmd, nullptr));
+
+  // tokens of an unknown or expired lease cannot be returned
+  cmd.clear();
+  folly::split(" ", folly::sformat("rl.release a 10 60 take 2 lease {} at 120", leaseId2 + 1000), cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.release", cmd, nullptr));
+
+  cmd.clear();
+  folly::split(" ", folly::sformat("rl.prelease a 10 60000 take 2 lease {} at 160000", leaseId1), cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.prelease", cmd, nullptr));
+
+  // release requires the lease id and the unused token count
+  cmd.clear();
+  folly::split(" ", "rl.release a 10 60 take 3 at 120", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(RateLimitHandler::errorSyntaxError()))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.release", cmd, nullptr));
+
+  cmd.clear();
+  folly::split(" ", folly::sformat("rl.release a 10 60 lease {} at 120", leaseId1), cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(RateLimitHandler::errorSyntaxError()))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.release", cmd, nullptr));
+
+  // lease options are not accepted by other commands
+  cmd.clear();
+  folly::split(" ", "rl.reduce a 10 60 ttl 30", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(RateLimitHandler::errorSyntaxError()))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+
+  cmd.clear();
+  folly::split(" ", folly::sformat("rl.reduce a 10 60 lease {}", leaseId1), cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(RateLimitHandler::errorSyntaxError()))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+}
+
+TEST_F(RateLimitHandlerTest, ParseDeadlineFallback) {
+  RateLimitHandler::DeadlineFallback fallback;
+  ASSERT_TRUE(RateLimitHandler::parseDeadlineFallback("allow", &fallback));
+  EXPECT_EQ(RateLimitHandler::DeadlineFallback::kAllow, fallback);
+  ASSERT_TRUE(RateLimitHandler::parseDeadlineFallback("DENY", &fallback));
+  EXPECT_EQ(RateLimitHandler::DeadlineFallback::kDeny, fallback);
+  ASSERT_TRUE(RateLimitHandler::parseDeadlineFallback("cached", &fallback));
+  EXPECT_EQ(RateLimitHandler::DeadlineFallback::kCached, fallback);
+  EXPECT_FALSE(RateLimitHandler::parseDeadlineFallback("maybe", &fallback));
+}
+
+TEST_F(RateLimitHandlerTest, DeadlineFallbacks) {
+  FLAGS_ratelimit_deadline_ms = 1;
+  std::string key;
+  RateLimitHandler::encodeRateLimitKey("a", { 10, 10, 60 * 1000 }, &key);
+  std::vector<std::string> cmd;
+  folly::split(" ", "rl.reduce a 10 60 at 100", cmd);
+
+  FLAGS_ratelimit_deadline_fallback = "deny";
+  MockRateLimitHandler denyHandler(databaseManager());
+  // requests within the deadline are not affected
+  EXPECT_CALL(denyHandler, write(nullptr, getRedisMessage(codec::RedisValue(10)))).Times(1);
+  EXPECT_TRUE(denyHandler.handleCommand("rl.reduce", cmd, nullptr));
+  {
+    // simulate a request stuck on the same key, and send ours from another thread as the lock is not recursive
+    std::lock_guard<std::timed_mutex> _guard(denyHandler.mutexFor(key));
+    EXPECT_CALL(denyHandler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+    std::thread([&] { EXPECT_TRUE(denyHandler.handleCommand("rl.reduce", cmd, nullptr)); }).join();
+  }
+  EXPECT_EQ(1u, denyHandler.getDeadlineFallbackCount(RateLimitHandler::DeadlineFallback::kDeny));
+
+  FLAGS_ratelimit_deadline_fallback = "cached";
+  MockRateLimitHandler cachedHandler(databaseManager());
+  {
+    // nothing cached yet, so fail open
+    std::lock_guard<std::timed_mutex> _guard(cachedHandler.mutexFor(key));
+    EXPECT_CALL(cachedHandler, write(nullptr, getRedisMessage(codec::RedisValue(10)))).Times(1);
+    std::thread([&] { EXPECT_TRUE(cachedHandler.handleCommand("rl.reduce", cmd, nullptr)); }).join();
+  }
+  EXPECT_EQ(1u, cachedHandler.getDeadlineFallbackCount(RateLimitHandler::DeadlineFallback::kAllow));
+  EXPECT_CALL(cachedHandler, write(nullptr, getRedisMessage(codec::RedisValue(9)))).Times(1);
+  EXPECT_TRUE(cachedHandler.handleCommand("rl.reduce", cmd, nullptr));
+  {
+    std::lock_guard<std::timed_mutex> _guard(cachedHandler.mutexFor(key));
+    EXPECT_CALL(cachedHandler, write(nullptr, getRedisMessage(codec::RedisValue(8)))).Times(1);
+    std::thread([&] { EXPECT_TRUE(cachedHandler.handleCommand("rl.reduce", cmd, nullptr)); }).join();
+  }
+  EXPECT_EQ(1u, cachedHandler.getDeadlineFallbackCount(RateLimitHandler::DeadlineFallback::kCached));
+
+  // fallback answers take nothing, so leases granted by them cannot be released
+  cmd.clear();
+  folly::split(" ", "rl.lease a 10 60 take 2 at 100", cmd);
+  {
+    std::lock_guard<std::timed_mutex> _guard(cachedHandler.mutexFor(key));
+    std::vector<codec::RedisValue> result = {codec::RedisValue(2), codec::RedisValue(160), codec::RedisValue(0)};
+    EXPECT_CALL(cachedHandler, write(nullptr, getRedisMessage(codec::RedisValue(std::move(result))))).Times(1);
+    std::thread([&] { EXPECT_TRUE(cachedHandler.handleCommand("rl.lease", cmd, nullptr)); }).join();
+  }
+
+  // releases that miss the deadline return nothing, and the lease keeps its tokens for a later release
+  RateLimitHandler::RedisIntType leaseId = 0;
+  cachedHandler.expectLease(2, 160, &leaseId);
+  EXPECT_TRUE(cachedHandler.handleCommand("rl.lease", cmd, nullptr));
+  cmd.clear();
+  folly::split(" ", folly::sformat("rl.release a 10 60 take 2 lease {} at 120", leaseId), cmd);
+  uint64_t cachedCount = cachedHandler.getDeadlineFallbackCount(RateLimitHandler::DeadlineFallback::kCached);
+  {
+    std::lock_guard<std::timed_mutex> _guard(cachedHandler.mutexFor(key));
+    EXPECT_CALL(cachedHandler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+    std::thread([&] { EXPECT_TRUE(cachedHandler.handleCommand("rl.release", cmd, nullptr)); }).join();
+  }
+  EXPECT_EQ(cachedCount + 1, cachedHandler.getDeadlineFallbackCount(RateLimitHandler::DeadlineFallback::kCached));
+  EXPECT_CALL(cachedHandler, write(nullptr, getRedisMessage(codec::RedisValue(2)))).Times(1);
+  EXPECT_TRUE(cachedHandler.handleCommand("rl.release", cmd, nullptr));
+
+  // and the cached amount includes the released tokens
+  cmd.clear();
+  folly::split(" ", "rl.reduce a 10 60 at 120", cmd);
+  {
+    std::lock_guard<std::timed_mutex> _guard(cachedHandler.mutexFor(key));
+    EXPECT_CALL(cachedHandler, write(nullptr, getRedisMessage(codec::RedisValue(8)))).Times(1);
+    std::thread([&] { EXPECT_TRUE(cachedHandler.handleCommand("rl.reduce", cmd, nullptr)); }).join();
+  }
+
+  // a sharded get shares one deadline over all its sub-buckets and falls back once
+  std::string shardKey;
+  RateLimitHandler::encodeRateLimitKey(RateLimitHandler::getShardKeyName("a", 1, 2), { 5, 5, 60 * 1000 }, &shardKey);
+  cmd.clear();
+  folly::split(" ", "rl.get a 10 60 shards 2 at 100", cmd);
+  {
+    std::lock_guard<std::timed_mutex> _guard(denyHandler.mutexFor(shardKey));
+    EXPECT_CALL(denyHandler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+    std::thread([&] { EXPECT_TRUE(denyHandler.handleCommand("rl.get", cmd, nullptr)); }).join();
+  }
+  EXPECT_EQ(2u, denyHandler.getDeadlineFallbackCount(RateLimitHandler::DeadlineFallback::kDeny));
+}
+
+TEST_F(RateLimitHandlerTest, DeadlineReader) {
+  MockRateLimitHandler handler(databaseManager());
+  rocksdb::DB* db = handler.db();
+  RateLimitDeadlineReader reader(db);
+  ASSERT_TRUE(db->Put(rocksdb::WriteOptions(), "a", "1").ok());
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+  std::string value;
+  ASSERT_TRUE(reader.get("a", deadline, &value).ok());
+  EXPECT_EQ("1", value);
+  EXPECT_TRUE(reader.get("b", deadline, &value).IsNotFound());
+
+  // reads of flushed buckets go through the reader threads when the block cache is cold
+  ASSERT_TRUE(db->Flush(rocksdb::FlushOptions()).ok());
+  ASSERT_TRUE(reader.get("a", deadline, &value).ok());
+  EXPECT_EQ("1", value);
+}
+
+TEST_F(RateLimitHandlerTest, HashedKeyNameCommands) {
+  FLAGS_ratelimit_hash_key_names = true;
+  MockRateLimitHandler handler(databaseManager());
+  std::vector<std::string> cmd;
+
+  folly::split(" ", "rl.reduce https://example.com/a/long/path|Mozilla/5.0|tenant 10 5 at 2 take 3", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(10)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+
+  cmd.clear();
+  folly::split(" ", "rl.get https://example.com/a/long/path|Mozilla/5.0|tenant 10 5 at 2", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(7)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.get", cmd, nullptr));
+}
+
+TEST_F(RateLimitHandlerTest, ShardArgs) {
+  RateLimitHandler::RateLimitArgs args{ 10, 60000, 7, 1, 100 };
+  RateLimitHandler::RedisIntType maxAmount = 0;
+  RateLimitHandler::RedisIntType refillAmount = 0;
+  for (RateLimitHandler::RedisIntType shard = 0; shard < 3; shard++) {
+    RateLimitHandler::RateLimitArgs shardArgs = RateLimitHandler::getShardArgs(args, shard, 3);
+    EXPECT_EQ(args.refillTimeMs, shardArgs.refillTimeMs);
+    EXPECT_EQ(args.clientTimeMs, shardArgs.clientTimeMs);
+    maxAmount += shardArgs.maxAmount;
+    refillAmount += shardArgs.refillAmount;
+  }
+  // shares add up to the logical bucket
+  EXPECT_EQ(args.maxAmount, maxAmount);
+  EXPECT_EQ(args.refillAmount, refillAmount);
+  EXPECT_EQ(4, RateLimitHandler::getShardArgs(args, 0, 3).maxAmount);
+  EXPECT_EQ(3, RateLimitHandler::getShardArgs(args, 2, 3).maxAmount);
+
+  EXPECT_NE(RateLimitHandler::getShardKeyName("a", 0, 2), RateLimitHandler::getShardKeyName("a", 1, 2));
+  EXPECT_NE("a", RateLimitHandler::getShardKeyName("a", 0, 2));
+
+  // rebalanced amounts follow the shares of 4, 3 and 3 tokens and add up to the amount
+  EXPECT_EQ(std::vector<RateLimitHandler::RedisIntType>({ 4, 3, 3 }), RateLimitHandler::rebalanceShards(args, 3, 10));
+  EXPECT_EQ(std::vector<RateLimitHandler::RedisIntType>({ 3, 2, 2 }), RateLimitHandler::rebalanceShards(args, 3, 7));
+  EXPECT_EQ(std::vector<RateLimitHandler::RedisIntType>({ 1, 0, 0 }), RateLimitHandler::rebalanceShards(args, 3, 1));
+  EXPECT_EQ(std::vector<RateLimitHandler::RedisIntType>({ 0, 0, 0 }), RateLimitHandler::rebalanceShards(args, 3, 0));
+}
+
+TEST_F(RateLimitHandlerTest, ShardedCommands) {
+  MockRateLimitHandler handler(databaseManager());
+  std::vector<std::string> cmd;
+
+  // the home sub-bucket holds 5 of the 10 tokens and covers the reduce, which still reports the total
+  folly::split(" ", "rl.reduce a 10 60 shards 2 take 3 at 100", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(10)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+
+  // home sub-bucket runs dry, so the tokens come from the total and the rest is rebalanced
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(7)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+
+  // gets report the total of all sub-buckets
+  cmd.clear();
+  folly::split(" ", "rl.get a 10 60 shards 2 at 100", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(4)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.get", cmd, nullptr));
+
+  // not enough tokens left in all sub-buckets together, so none are taken
+  std::vector<std::string> reduceCmd;
+  folly::split(" ", "rl.reduce a 10 60 shards 2 take 5 at 100", reduceCmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(4)))).Times(2);
+  EXPECT_TRUE(handler.handleCommand("rl.reduce", reduceCmd, nullptr));
+  EXPECT_TRUE(handler.handleCommand("rl.get", cmd, nullptr));
+
+  // rebalancing spreads what is left over the sub-buckets by their shares of 4, 3 and 3 tokens
+  cmd.clear();
+  folly::split(" ", "rl.reduce b 10 60 shards 3 take 5 at 100", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(10)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+  RateLimitHandler::RateLimitArgs args{ 10, 60000, 10, 0, 100 };
+  std::vector<RateLimitHandler::RedisIntType> amounts;
+  for (RateLimitHandler::RedisIntType shard = 0; shard < 3; shard++) {
+    std::string key;
+    RateLimitHandler::RedisIntType refilledAtMs;
+    amounts.push_back(handler.getAdjustedAmountFromDb(RateLimitHandler::getShardKeyName("b", shard, 3),
+                                                      RateLimitHandler::getShardArgs(args, shard, 3), &key,
+                                                      &refilledAtMs, nullptr));
+  }
+  EXPECT_EQ(std::vector<RateLimitHandler::RedisIntType>({ 3, 1, 1 }), amounts);
+
+  // Reduces add up the other sub-buckets from the amounts they were last written with, without reading them. Change
+  // both sub-buckets behind the handler's back, so that the total shows which of them was read.
+  cmd.clear();
+  folly::split(" ", "rl.get c 10 60 shards 2 at 100", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(10)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.get", cmd, nullptr));
+  for (RateLimitHandler::RedisIntType shard = 0; shard < 2; shard++) {
+    RateLimitHandler::RateLimitArgs shardArgs = RateLimitHandler::getShardArgs(args, shard, 2);
+    std::string key;
+    RateLimitHandler::encodeRateLimitKey(RateLimitHandler::getShardKeyName("c", shard, 2),
+                                         { shardArgs.maxAmount, shardArgs.refillAmount, shardArgs.refillTimeMs }, &key);
+    std::string value;
+    RateLimitHandler::encodeRateLimitValue(RateLimitHandler::ValueParams{ 2, 100, 100 }, &value);
+    ASSERT_TRUE(handler.db()->Put(rocksdb::WriteOptions(), key, value).ok());
+  }
+  cmd.clear();
+  folly::split(" ", "rl.reduce c 10 60 shards 2 at 100", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(7)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+
+  // sharded buckets are separate from the unsharded one
+  cmd.clear();
+  folly::split(" ", "rl.get a 10 60 at 100", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(10)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.get", cmd, nullptr));
+
+  cmd.clear();
+  folly::split(" ", "rl.sessionize a 10 60 shards 2 at 100", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(RateLimitHandler::errorSyntaxError()))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.sessionize", cmd, nullptr));
+
+  // no single sub-bucket runs dry when the whole bucket does, which strict mode relies on
+  cmd.clear();
+  folly::split(" ", "rl.reduce a 10 60 shards 2 strict at 100", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(RateLimitHandler::errorSyntaxError()))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+}
+
+TEST_F(RateLimitHandlerTest, WaitCommands) {
+  MockRateLimitHandler handler(databaseManager());
+  std::vector<std::string> cmd;
+
+  // enough tokens, no need to wait
+  folly::split(" ", "rl.pwait a 10 1000 refill 5 take 8 at 0", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.pwait", cmd, nullptr));
+
+  // two refills needed, which is more than the default timeout of one refill time
+  cmd.clear();
+  folly::split(" ", "rl.pwait a 10 1000 refill 5 take 8 at 100", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(-1)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.pwait", cmd, nullptr));
+
+  // reserved until the second refill
+  cmd.clear();
+  folly::split(" ", "rl.pwait a 10 1000 refill 5 take 8 timeout 2000 at 100", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(1900)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.pwait", cmd, nullptr));
+
+  // the bucket is in debt, which neither gets nor reduces can see or cancel
+  cmd.clear();
+  folly::split(" ", "rl.preduce a 10 1000 refill 5 at 100", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.preduce", cmd, nullptr));
+
+  // waiting for no tokens returns right away and leaves the debt alone
+  cmd.clear();
+  folly::split(" ", "rl.pwait a 10 1000 refill 5 take 0 at 1000", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.pwait", cmd, nullptr));
+
+  cmd.clear();
+  folly::split(" ", "rl.pget a 10 1000 refill 5 at 1000", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.pget", cmd, nullptr));
+
+  // what is left once the reservation is paid back
+  cmd.clear();
+  folly::split(" ", "rl.pget a 10 1000 refill 5 at 2000", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(4)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.pget", cmd, nullptr));
+
+  // never available
+  cmd.clear();
+  folly::split(" ", "rl.pwait a 10 1000 refill 5 take 11 timeout 100000 at 2000", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(-1)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.pwait", cmd, nullptr));
+
+  // waits in seconds are rounded up
+  cmd.clear();
+  folly::split(" ", "rl.wait b 10 60 take 10 at 0", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.wait", cmd, nullptr));
+
+  cmd.clear();
+  folly::split(" ", "rl.pwait b 10 60000 take 1 at 29500", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(30500)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.pwait", cmd, nullptr));
+
+  cmd.clear();
+  folly::split(" ", "rl.wait b 10 60 take 1 at 30", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(30)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.wait", cmd, nullptr));
+}
+
+TEST_F(RateLimitHandlerTest, RecordCommands) {
+  MockRateLimitHandler handler(databaseManager());
+  std::vector<std::string> cmd;
+
+  folly::split(" ", "rl.record a 10 5 at 2 take 3", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(RateLimitHandler::simpleStringOk()))).Times(2);
+  EXPECT_TRUE(handler.handleCommand("rl.record", cmd, nullptr));
+  cmd.clear();
+  folly::split(" ", "rl.precord a 10 5000 at 3000", cmd);
+  EXPECT_TRUE(handler.handleCommand("rl.precord", cmd, nullptr));
+
+  // reads see the merged value
+  cmd.clear();
+  folly::split(" ", "rl.get a 10 5 at 4", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(6)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.get", cmd, nullptr));
+
+  // and so do reduces
+  cmd.clear();
+  folly::split(" ", "rl.reduce a 10 5 at 4 take 6", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(6)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+
+  // recording on an empty bucket does not put it into debt
+  cmd.clear();
+  folly::split(" ", "rl.record a 10 5 at 5 take 4", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(RateLimitHandler::simpleStringOk()))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.record", cmd, nullptr));
+  cmd.clear();
+  folly::split(" ", "rl.get a 10 5 at 7", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(10)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.get", cmd, nullptr));
+
+  // all optional arguments at once
+  cmd.clear();
+  folly::split(" ", "rl.record c 10 5 refill 2 take 3 at 2", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(RateLimitHandler::simpleStringOk()))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.record", cmd, nullptr));
+  cmd.clear();
+  folly::split(" ", "rl.get c 10 5 refill 2 at 2", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(7)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.get", cmd, nullptr));
+
+  // a record arriving while a reduce holds the bucket between its read and its write is not lost
+  RateLimitHandler::RateLimitArgs args{ 10, 60000, 10, 2, 100000 };
+  std::string key;
+  RateLimitHandler::encodeRateLimitKey("b", { args.maxAmount, args.refillAmount, args.refillTimeMs }, &key);
+  cmd.clear();
+  folly::split(" ", "rl.record b 10 60 at 100 take 3", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(RateLimitHandler::simpleStringOk()))).Times(1);
+  std::thread recordThread;
+  {
+    std::lock_guard<std::timed_mutex> _guard(handler.mutexFor(key));
+    RateLimitHandler::RedisIntType refilledAtMs;
+    RateLimitHandler::RedisIntType amount = handler.getAdjustedAmountFromDb(key, args, &refilledAtMs, nullptr);
+    recordThread = std::thread([&] { EXPECT_TRUE(handler.handleCommand("rl.record", cmd, nullptr)); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    RateLimitHandler::ValueParams valueParams{ amount - args.tokenAmount, refilledAtMs, args.clientTimeMs };
+    std::string valueBuf;
+    EXPECT_TRUE(handler.db()->Put(rocksdb::WriteOptions(), key,
+                                  RateLimitHandler::encodeRateLimitValue(valueParams, &valueBuf)).ok());
+  }
+  recordThread.join();
+  cmd.clear();
+  folly::split(" ", "rl.get b 10 60 at 100", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(5)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.get", cmd, nullptr));
+}
+
+TEST_F(RateLimitHandlerTest, WarmSnapshot) {
+  FLAGS_ratelimit_warm_snapshot_path = tempDir() + "/warm-snapshot";
+  {
+    // no snapshot to preload on the first start
+    MockRateLimitHandler handler(databaseManager());
+    EXPECT_EQ(0u, handler.getPreloadedKeyCount());
+
+    std::vector<std::string> cmd;
+    EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(10)))).Times(3);
+    for (const char* keyName : { "a", "b", "c" }) {
+      cmd.clear();
+      folly::split(" ", folly::sformat("rl.reduce {} 10 60", keyName), cmd);
+      EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+    }
+    // buckets that were never reduced are left out
+    cmd.clear();
+    folly::split(" ", "rl.get d 10 60", cmd);
+    EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(10)))).Times(1);
+    EXPECT_TRUE(handler.handleCommand("rl.get", cmd, nullptr));
+  }
+  {
+    MockRateLimitHandler handler(databaseManager());
+    EXPECT_EQ(3u, handler.getPreloadedKeyCount());
+  }
+  {
+    // nothing was reduced since the last start
+    MockRateLimitHandler handler(databaseManager());
+    EXPECT_EQ(0u, handler.getPreloadedKeyCount());
+  }
+}
+
+TEST_F(RateLimitHandlerTest, RecentKeys) {
+  // room for a single key keeps the most recent one
+  RateLimitRecentKeys recentKeys(1);
+  recentKeys.touch("a", 100);
+  recentKeys.touch("b", 200);
+  recentKeys.touch("a", 300);
+  std::vector<std::string> keys = recentKeys.getRecentKeys(300, 1000);
+  ASSERT_EQ(1u, keys.size());
+  EXPECT_EQ("a", keys[0]);
+
+  RateLimitRecentKeys moreKeys(1000);
+  moreKeys.touch("a", 100);
+  moreKeys.touch("b", 200);
+  moreKeys.touch("c", 300);
+  moreKeys.touch("a", 400);
+  EXPECT_EQ(std::vector<std::string>({ "a", "c", "b" }), moreKeys.getRecentKeys(400, 1000));
+  // keys reduced too long ago are left out
+  EXPECT_EQ(std::vector<std::string>({ "a", "c" }), moreKeys.getRecentKeys(1250, 1000));
+
+  // a capacity that does not split evenly over the stripes is still filled
+  RateLimitRecentKeys unevenKeys(100);
+  for (int i = 0; i < 10000; i++) unevenKeys.touch(folly::to<std::string>(i), 100);
+  EXPECT_EQ(100u, unevenKeys.getRecentKeys(100, 1000).size());
+}
+
+TEST_F(RateLimitHandlerTest, OverrideTable) {
+  std::string path = tempDir() + "/overrides";
+  writeOverrideTable({
+    { "internal:", true, 0, 0, 0 },
+    { "partner:", false, 100, 0, 0 },
+    { "partner:acme:", false, 1000, 500, 0 },
+  }, path);
+
+  std::shared_ptr<const RateLimitOverrideTable> table;
+  ASSERT_TRUE(RateLimitOverrideTable::load(path, &table).ok());
+  EXPECT_EQ(3u, table->size());
+  RateLimitOverrideTable::Entry entry;
+  EXPECT_TRUE(table->lookup("internal:search", &entry));
+  EXPECT_TRUE(entry.exempt);
+  // the longest prefix wins
+  EXPECT_TRUE(table->lookup("partner:acme:login", &entry));
+  EXPECT_FALSE(entry.exempt);
+  EXPECT_EQ(1000, entry.maxAmount);
+  EXPECT_EQ(500, entry.refillTimeMs);
+  EXPECT_TRUE(table->lookup("partner:other:login", &entry));
+  EXPECT_EQ(100, entry.maxAmount);
+  EXPECT_EQ(0, entry.refillTimeMs);
+  EXPECT_FALSE(table->lookup("partner", &entry));
+  EXPECT_FALSE(table->lookup("user:1", &entry));
+
+  std::string compiled;
+  EXPECT_TRUE(RateLimitOverrideTable::compile({ { "a", true, 0, 0, 0 }, { "a", false, 1, 1, 1 } }, &compiled)
+                  .IsInvalidArgument());
+  EXPECT_TRUE(RateLimitOverrideTable::compile({ { "", true, 0, 0, 0 } }, &compiled).IsInvalidArgument());
+  // an empty table is valid and matches nothing
+  EXPECT_TRUE(RateLimitOverrideTable::compile({}, &compiled).ok());
+
+  std::ofstream(path, std::ios::binary | std::ios::trunc) << "RLOT but not really a table";
+  EXPECT_TRUE(RateLimitOverrideTable::load(path, &table).IsCorruption());
+  // a failed load leaves the table in place
+  EXPECT_EQ(3u, table->size());
+
+  // headers that do not match the slots are rejected, the words after magic and version being the slot count, the
+  // entry count, the prefix length count and the prefix lengths
+  ASSERT_TRUE(RateLimitOverrideTable::compile({ { "a", true, 0, 0, 0 } }, &compiled).ok());
+  auto writeHeaderWord = [&](size_t word, uint32_t value) {
+    std::string broken = compiled;
+    std::memcpy(&broken[sizeof(uint32_t) * word], &value, sizeof(value));
+    std::ofstream(path, std::ios::binary | std::ios::trunc).write(broken.data(), broken.size());
+  };
+  writeHeaderWord(3, 0);
+  EXPECT_TRUE(RateLimitOverrideTable::load(path, &table).IsCorruption());
+  writeHeaderWord(5, 0);
+  EXPECT_TRUE(RateLimitOverrideTable::load(path, &table).IsCorruption());
+  writeHeaderWord(4, 2);
+  EXPECT_TRUE(RateLimitOverrideTable::load(path, &table).IsCorruption());
+  writeHeaderWord(3, 1);
+  EXPECT_TRUE(RateLimitOverrideTable::load(path, &table).ok());
+  EXPECT_EQ(1u, table->size());
+
+  // the loaded table is a copy, so rewriting the file in place does not affect it
+  std::ofstream(path, std::ios::binary | std::ios::trunc) << "RLOT";
+  EXPECT_TRUE(table->lookup("a:1", &entry));
+  std::remove(path.c_str());
+  EXPECT_TRUE(RateLimitOverrideTable::load(path, &table).IsIOError());
+}
+
+TEST_F(RateLimitHandlerTest, OverrideReloader) {
+  std::string path = tempDir() + "/overrides";
+  writeOverrideTable({ { "a:", true, 0, 0, 0 } }, path);
+  // reload explicitly instead of waiting for the background thread
+  RateLimitOverrideReloader reloader(path, 3600 * 1000);
+  std::shared_ptr<const RateLimitOverrideTable> table = reloader.getTable();
+  ASSERT_TRUE(table != nullptr);
+  EXPECT_EQ(1u, table->size());
+
+  reloader.reloadIfChanged();
+  EXPECT_EQ(table, reloader.getTable());
+
+  writeOverrideTable({ { "a:", true, 0, 0, 0 }, { "b:", true, 0, 0, 0 } }, path);
+  reloader.reloadIfChanged();
+  EXPECT_EQ(2u, reloader.getTable()->size());
+  // readers holding the previous version can still use it
+  RateLimitOverrideTable::Entry entry;
+  EXPECT_TRUE(table->lookup("a:1", &entry));
+  EXPECT_FALSE(table->lookup("b:1", &entry));
+
+  // a broken file keeps the current version
+  std::ofstream(path + ".tmp", std::ios::binary | std::ios::trunc) << "broken";
+  ASSERT_EQ(0, std::rename((path + ".tmp").c_str(), path.c_str()));
+  reloader.reloadIfChanged();
+  EXPECT_EQ(2u, reloader.getTable()->size());
+}
+
+TEST_F(RateLimitHandlerTest, OverrideCommands) {
+  FLAGS_ratelimit_overrides_path = tempDir() + "/overrides";
+  writeOverrideTable({ { "internal:", true, 0, 0, 0 }, { "partner:", false, 100, 0, 0 } },
+                     FLAGS_ratelimit_overrides_path);
+  MockRateLimitHandler handler(databaseManager());
+  std::vector<std::string> cmd;
+
+  // exempt keys always see a full bucket
+  folly::split(" ", "rl.reduce internal:search 2 60 take 2", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(2)))).Times(3);
+  for (int i = 0; i < 3; i++) EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+
+  // every session start is reported in milliseconds, like for limited keys
+  cmd.clear();
+  std::vector<codec::RedisValue> sessionResult = {codec::RedisValue(2), codec::RedisValue(1000000)};
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(std::move(sessionResult))))).Times(1);
+  folly::split(" ", "rl.sessionize internal:search 2 60 at 1000 STRICT", cmd);
+  EXPECT_TRUE(handler.handleCommand("rl.sessionize", cmd, nullptr));
+
+  // and leases grant every requested token, without a lease to release as nothing was taken
+  cmd.clear();
+  std::vector<codec::RedisValue> leaseResult = {codec::RedisValue(5), codec::RedisValue(1060), codec::RedisValue(0)};
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(std::move(leaseResult))))).Times(1);
+  folly::split(" ", "rl.lease internal:search 2 60 take 5 at 1000", cmd);
+  EXPECT_TRUE(handler.handleCommand("rl.lease", cmd, nullptr));
+
+  cmd.clear();
+  folly::split(" ", "rl.wait internal:search 2 60 take 2", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.wait", cmd, nullptr));
+
+  // overridden keys use the configuration from the table, whatever the client sends
+  cmd.clear();
+  folly::split(" ", "rl.reduce partner:acme 2 60", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(100)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(99)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+
+  // other keys are limited as usual
+  cmd.clear();
+  folly::split(" ", "rl.reduce user:1 2 60 take 2", cmd);
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(2)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+  EXPECT_CALL(handler, write(nullptr, getRedisMessage(codec::RedisValue(0)))).Times(1);
+  EXPECT_TRUE(handler.handleCommand("rl.reduce", cmd, nullptr));
+}
+
 }  // namespace ratelimit
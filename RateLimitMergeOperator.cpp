@@ -0,0 +1,59 @@
+#include "ratelimit/RateLimitMergeOperator.h"
+
+#include <algorithm>
+#include <string>
+
+#include "glog/logging.h"
+
+#include "ratelimit/RateLimitHandler.h"
+
+namespace ratelimit {
+
+bool RateLimitMergeOperator::FullMergeV2(const MergeOperationInput& mergeIn, MergeOperationOutput* mergeOut) const {
+  RateLimitHandler::KeyParams keyParams;
+  if (!RateLimitHandler::decodeRateLimitKey(mergeIn.key, &keyParams)) {
+    LOG(ERROR) << "RateLimit key in RocksDB is corrupted";
+    return false;
+  }
+
+  RateLimitHandler::ValueParams valueParams;
+  bool hasValue = mergeIn.existing_value != nullptr;
+  if (hasValue && !RateLimitHandler::decodeRateLimitValue(*mergeIn.existing_value, &valueParams, nullptr)) {
+    LOG(ERROR) << "RateLimit value in RocksDB is corrupted";
+    return false;
+  }
+
+  for (const auto& operand : mergeIn.operand_list) {
+    RateLimitHandler::MergeParams mergeParams;
+    if (!RateLimitHandler::decodeMergeOperand(operand, &mergeParams)) {
+      LOG(ERROR) << "RateLimit merge operand in RocksDB is corrupted";
+      return false;
+    }
+    if (!hasValue) {
+      // no such key means the full amount is available
+      valueParams = { keyParams.maxAmount, mergeParams.clientTimeMs, mergeParams.serverTimeMs };
+      hasValue = true;
+    }
+    RateLimitHandler::RateLimitArgs args{ keyParams.maxAmount, keyParams.refillTimeMs, keyParams.refillAmount,
+                                          mergeParams.tokenAmount, mergeParams.clientTimeMs };
+    RedisIntType newRefilledAtMs;
+    RedisIntType adjustedAmount =
+        RateLimitHandler::adjustAmount(valueParams.amount, valueParams.lastRefilledAtMs, args, &newRefilledAtMs);
+    valueParams.amount = RateLimitHandler::reduceAmount(adjustedAmount, mergeParams.tokenAmount);
+    valueParams.lastRefilledAtMs = newRefilledAtMs;
+    valueParams.lastReducedAtMs = std::max(valueParams.lastReducedAtMs, mergeParams.serverTimeMs);
+  }
+  // there is always either an existing value or an operand
+  if (!hasValue) return false;
+
+  mergeOut->new_value.clear();
+  RateLimitHandler::encodeRateLimitValue(valueParams, &mergeOut->new_value);
+  // keep session params, if any, untouched
+  if (mergeIn.existing_value != nullptr) {
+    mergeOut->new_value.append(mergeIn.existing_value->data() + sizeof(valueParams),
+                               mergeIn.existing_value->size() - sizeof(valueParams));
+  }
+  return true;
+}
+
+}  // namespace ratelimit
@@ -0,0 +1,22 @@
+#ifndef RATELIMIT_RATELIMITMERGEOPERATOR_H_
+#define RATELIMIT_RATELIMITMERGEOPERATOR_H_
+
+#include "codec/RedisValue.h"
+#include "rocksdb/merge_operator.h"
+
+namespace ratelimit {
+
+// Folds "take N tokens at time T" operands written by RL.RECORD into the stored bucket, refilling it between operands
+// the same way `RateLimitHandler::adjustAmount` does
+class RateLimitMergeOperator : public rocksdb::MergeOperator {
+ public:
+  bool FullMergeV2(const MergeOperationInput& mergeIn, MergeOperationOutput* mergeOut) const override;
+  const char* Name() const override { return "RateLimitMergeOperator"; }
+
+ private:
+  using RedisIntType = codec::RedisValue::IntType;
+};
+
+}  // namespace ratelimit
+
+#endif  // RATELIMIT_RATELIMITMERGEOPERATOR_H_
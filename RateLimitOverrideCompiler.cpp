@@ -0,0 +1,82 @@
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "folly/Conv.h"
+#include "folly/String.h"
+#include "gflags/gflags.h"
+#include "glog/logging.h"
+#include "ratelimit/RateLimitOverrideTable.h"
+
+DEFINE_string(input, "", "Text file of overrides, one per line as `prefix exempt` or "
+              "`prefix maxAmount refillTime refillAmount` where `-` keeps the client-provided value. Lines starting "
+              "with # are comments");
+DEFINE_string(output, "", "Where to write the compiled table, replaced atomically so that servers pick it up whole");
+
+namespace ratelimit {
+
+namespace {
+
+RateLimitOverrideTable::RedisIntType parseOverride(const std::string& value) {
+  // 0 tells the server to keep the client-provided value
+  if (value == "-") return 0;
+  return folly::to<RateLimitOverrideTable::RedisIntType>(value);
+}
+
+bool parseLine(const std::string& line, RateLimitOverrideTable::Entry* entry) {
+  std::vector<std::string> fields;
+  folly::split(' ', line, fields, true);
+  if (fields.size() == 2 && fields[1] == "exempt") {
+    *entry = RateLimitOverrideTable::Entry{ fields[0], true, 0, 0, 0 };
+    return true;
+  }
+  if (fields.size() != 4) return false;
+  try {
+    *entry = RateLimitOverrideTable::Entry{ fields[0], false, parseOverride(fields[1]), parseOverride(fields[2]),
+                                            parseOverride(fields[3]) };
+  } catch (std::range_error&) {
+    return false;
+  }
+  return true;
+}
+
+}  // namespace
+
+}  // namespace ratelimit
+
+int main(int argc, char** argv) {
+  gflags::SetUsageMessage("Compile a table of rate limit overrides for --ratelimit_overrides_path");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  google::InitGoogleLogging(argv[0]);
+  CHECK(!FLAGS_input.empty() && !FLAGS_output.empty()) << "Both --input and --output are required";
+
+  std::ifstream input(FLAGS_input);
+  CHECK(input) << "Cannot open " << FLAGS_input;
+  std::vector<ratelimit::RateLimitOverrideTable::Entry> entries;
+  std::string line;
+  for (int lineNumber = 1; std::getline(input, line); lineNumber++) {
+    std::string trimmed = folly::trimWhitespace(line).str();
+    if (trimmed.empty() || trimmed[0] == '#') continue;
+    ratelimit::RateLimitOverrideTable::Entry entry;
+    CHECK(ratelimit::parseLine(trimmed, &entry)) << "Malformed override on line " << lineNumber << ": " << line;
+    entries.push_back(std::move(entry));
+  }
+
+  std::string table;
+  rocksdb::Status status = ratelimit::RateLimitOverrideTable::compile(entries, &table);
+  CHECK(status.ok()) << "Cannot compile overrides: " << status.ToString();
+
+  std::string tmpPath = FLAGS_output + ".tmp";
+  {
+    std::ofstream output(tmpPath, std::ios::binary | std::ios::trunc);
+    output.write(table.data(), table.size());
+    output.flush();
+    CHECK(output) << "Cannot write " << tmpPath;
+  }
+  CHECK_EQ(std::rename(tmpPath.c_str(), FLAGS_output.c_str()), 0) << "Cannot replace " << FLAGS_output;
+  LOG(INFO) << "Compiled " << entries.size() << " overrides into " << FLAGS_output;
+  return 0;
+}
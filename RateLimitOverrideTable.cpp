@@ -0,0 +1,218 @@
+#include "ratelimit/RateLimitOverrideTable.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "folly/SpookyHashV2.h"
+#include "glog/logging.h"
+
+namespace ratelimit {
+
+uint64_t RateLimitOverrideTable::hashPrefix(const char* data, size_t size) {
+  return folly::hash::SpookyHashV2::Hash64(data, size, 0);
+}
+
+rocksdb::Status RateLimitOverrideTable::compile(const std::vector<Entry>& entries, std::string* out) {
+  Header header = {};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.entryCount = entries.size();
+  // keep the load factor at or below one half so that probe sequences stay short
+  header.slotCount = 1;
+  while (header.slotCount < 2 * entries.size()) header.slotCount *= 2;
+
+  std::set<uint32_t, std::greater<uint32_t>> prefixLengths;
+  for (const auto& entry : entries) {
+    if (entry.prefix.empty()) return rocksdb::Status::InvalidArgument("Empty prefix");
+    if (!entry.exempt && (entry.maxAmount < 0 || entry.refillTimeMs < 0 || entry.refillAmount < 0)) {
+      return rocksdb::Status::InvalidArgument("Negative override for prefix", entry.prefix);
+    }
+    prefixLengths.insert(entry.prefix.size());
+  }
+  if (prefixLengths.size() > kMaxPrefixLengths) {
+    return rocksdb::Status::InvalidArgument("Too many distinct prefix lengths");
+  }
+  for (uint32_t prefixLength : prefixLengths) header.prefixLengths[header.prefixLengthCount++] = prefixLength;
+
+  std::vector<Slot> slots(header.slotCount, Slot());
+  std::string prefixes;
+  size_t prefixesOffset = sizeof(Header) + sizeof(Slot) * slots.size();
+  uint32_t mask = header.slotCount - 1;
+  for (const auto& entry : entries) {
+    uint64_t hash = hashPrefix(entry.prefix.data(), entry.prefix.size());
+    uint32_t i = hash & mask;
+    while (slots[i].flags & kOccupiedFlag) {
+      const Slot& other = slots[i];
+      if (other.hash == hash && other.prefixSize == entry.prefix.size() &&
+          prefixes.compare(other.prefixOffset - prefixesOffset, other.prefixSize, entry.prefix) == 0) {
+        return rocksdb::Status::InvalidArgument("Duplicate prefix", entry.prefix);
+      }
+      i = (i + 1) & mask;
+    }
+    Slot& slot = slots[i];
+    slot.hash = hash;
+    slot.prefixOffset = prefixesOffset + prefixes.size();
+    slot.prefixSize = entry.prefix.size();
+    slot.maxAmount = entry.maxAmount;
+    slot.refillTimeMs = entry.refillTimeMs;
+    slot.refillAmount = entry.refillAmount;
+    slot.flags = kOccupiedFlag | (entry.exempt ? kExemptFlag : 0);
+    prefixes.append(entry.prefix);
+  }
+
+  out->clear();
+  out->append(reinterpret_cast<const char *>(&header), sizeof(header));
+  out->append(reinterpret_cast<const char *>(slots.data()), sizeof(Slot) * slots.size());
+  out->append(prefixes);
+  return rocksdb::Status::OK();
+}
+
+rocksdb::Status RateLimitOverrideTable::load(const std::string& path,
+                                             std::shared_ptr<const RateLimitOverrideTable>* table) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) return rocksdb::Status::IOError("Cannot open override table", path);
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+    ::close(fd);
+    return rocksdb::Status::Corruption("Override table is truncated", path);
+  }
+  // Copy the file instead of mapping it, so that a file rewritten in place can never pull pages out from under
+  // lookups. Words keep the slots aligned.
+  size_t size = st.st_size;
+  std::unique_ptr<uint64_t[]> buffer(new uint64_t[(size + sizeof(uint64_t) - 1) / sizeof(uint64_t)]);
+  char* data = reinterpret_cast<char*>(buffer.get());
+  size_t offset = 0;
+  while (offset < size) {
+    ssize_t bytesRead = ::pread(fd, data + offset, size - offset, offset);
+    if (bytesRead < 0 && errno == EINTR) continue;
+    if (bytesRead <= 0) break;
+    offset += bytesRead;
+  }
+  ::close(fd);
+  if (offset < size) return rocksdb::Status::IOError("Cannot read override table", path);
+  std::shared_ptr<const RateLimitOverrideTable> newTable(new RateLimitOverrideTable(std::move(buffer), size));
+
+  // validate everything up front so that lookups can trust the table
+  const Header& header = *newTable->header_;
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion) {
+    return rocksdb::Status::Corruption("Unknown override table format", path);
+  }
+  if (header.slotCount == 0 || (header.slotCount & (header.slotCount - 1)) != 0 ||
+      header.entryCount >= header.slotCount || header.prefixLengthCount > kMaxPrefixLengths ||
+      size < sizeof(Header) + sizeof(Slot) * static_cast<size_t>(header.slotCount)) {
+    return rocksdb::Status::Corruption("Override table is malformed", path);
+  }
+  // a prefix length of 0 would match every key, and lookups rely on the longest prefix coming first
+  for (uint32_t l = 0; l < header.prefixLengthCount; l++) {
+    if (header.prefixLengths[l] == 0 || (l > 0 && header.prefixLengths[l] >= header.prefixLengths[l - 1])) {
+      return rocksdb::Status::Corruption("Override table prefix lengths are malformed", path);
+    }
+  }
+  uint32_t occupiedSlots = 0;
+  for (uint32_t i = 0; i < header.slotCount; i++) {
+    const Slot& slot = newTable->slots_[i];
+    if (!(slot.flags & kOccupiedFlag)) continue;
+    occupiedSlots++;
+    if (static_cast<size_t>(slot.prefixOffset) + slot.prefixSize > size) {
+      return rocksdb::Status::Corruption("Override table is truncated", path);
+    }
+  }
+  // probing relies on an empty slot to end, which a full table would not have
+  if (occupiedSlots != header.entryCount) {
+    return rocksdb::Status::Corruption("Override table entry count does not match its slots", path);
+  }
+
+  *table = std::move(newTable);
+  return rocksdb::Status::OK();
+}
+
+bool RateLimitOverrideTable::lookup(const std::string& keyName, RateLimitOverrideTable::Entry* entry) const {
+  uint32_t mask = header_->slotCount - 1;
+  for (uint32_t l = 0; l < header_->prefixLengthCount; l++) {
+    uint32_t prefixLength = header_->prefixLengths[l];
+    if (prefixLength > keyName.size()) continue;
+    uint64_t hash = hashPrefix(keyName.data(), prefixLength);
+    // the load factor guarantees an empty slot, which ends the probe sequence
+    for (uint32_t i = hash & mask; slots_[i].flags & kOccupiedFlag; i = (i + 1) & mask) {
+      const Slot& slot = slots_[i];
+      if (slot.hash != hash || slot.prefixSize != prefixLength ||
+          std::memcmp(data_ + slot.prefixOffset, keyName.data(), prefixLength) != 0) {
+        continue;
+      }
+      entry->prefix.clear();
+      entry->exempt = slot.flags & kExemptFlag;
+      entry->maxAmount = slot.maxAmount;
+      entry->refillTimeMs = slot.refillTimeMs;
+      entry->refillAmount = slot.refillAmount;
+      return true;
+    }
+  }
+  return false;
+}
+
+RateLimitOverrideReloader::RateLimitOverrideReloader(std::string path, int reloadIntervalMs)
+    : path_(std::move(path)), reloadIntervalMs_(reloadIntervalMs) {
+  // the initial load happens before any lookup
+  reloadIfChanged();
+  thread_ = std::thread(&RateLimitOverrideReloader::run, this);
+}
+
+RateLimitOverrideReloader::~RateLimitOverrideReloader() {
+  {
+    std::lock_guard<std::mutex> _guard(mutex_);
+    stopping_ = true;
+  }
+  stopCv_.notify_all();
+  thread_.join();
+}
+
+void RateLimitOverrideReloader::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopCv_.wait_for(lock, std::chrono::milliseconds(reloadIntervalMs_), [this] { return stopping_; })) {
+    lock.unlock();
+    reloadIfChanged();
+    lock.lock();
+  }
+}
+
+void RateLimitOverrideReloader::reloadIfChanged() {
+  struct stat st;
+  if (::stat(path_.c_str(), &st) != 0) {
+    LOG_EVERY_N(ERROR, 60) << "Cannot stat override table " << path_;
+    return;
+  }
+  int64_t mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+  if (std::atomic_load(&table_) && st.st_ino == inode_ && mtimeNs == mtimeNs_) return;
+
+  std::shared_ptr<const RateLimitOverrideTable> table;
+  rocksdb::Status status = RateLimitOverrideTable::load(path_, &table);
+  if (!status.ok()) {
+    LOG(ERROR) << "Cannot load override table, keeping the current one: " << status.ToString();
+    return;
+  }
+  std::atomic_store(&table_, table);
+  inode_ = st.st_ino;
+  mtimeNs_ = mtimeNs;
+  LOG(INFO) << "Loaded " << table->size() << " entries from override table " << path_;
+}
+
+constexpr char RateLimitOverrideTable::kMagic[4];
+constexpr uint32_t RateLimitOverrideTable::kVersion;
+constexpr uint32_t RateLimitOverrideTable::kMaxPrefixLengths;
+constexpr uint32_t RateLimitOverrideTable::kExemptFlag;
+constexpr uint32_t RateLimitOverrideTable::kOccupiedFlag;
+
+}  // namespace ratelimit
@@ -0,0 +1,124 @@
+#ifndef RATELIMIT_RATELIMITOVERRIDETABLE_H_
+#define RATELIMIT_RATELIMITOVERRIDETABLE_H_
+
+#include <sys/types.h>
+
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "codec/RedisValue.h"
+#include "rocksdb/status.h"
+
+namespace ratelimit {
+
+// Read-only hash table of key name prefixes that are exempt from rate limiting or use a different configuration.
+// Tables are compiled ahead of time and read into memory as is, so loading one costs no parsing and no allocation per
+// entry, and a lookup hashes the key name once per distinct prefix length in the table.
+class RateLimitOverrideTable {
+ public:
+  using RedisIntType = codec::RedisValue::IntType;
+
+  struct Entry {
+    std::string prefix;
+    // exempt keys are never limited and the configuration below is ignored
+    bool exempt;
+    // replace the client-provided configuration unless 0
+    RedisIntType maxAmount;
+    RedisIntType refillTimeMs;
+    RedisIntType refillAmount;
+  };
+
+  // Build the file contents of a table holding `entries`
+  static rocksdb::Status compile(const std::vector<Entry>& entries, std::string* out);
+  // Read a compiled table and validate it
+  static rocksdb::Status load(const std::string& path, std::shared_ptr<const RateLimitOverrideTable>* table);
+
+  // Find the entry of the longest prefix of `keyName` in the table; `entry->prefix` is left empty
+  bool lookup(const std::string& keyName, Entry* entry) const;
+
+  size_t size() const { return header_->entryCount; }
+
+ private:
+  static constexpr char kMagic[4] = { 'R', 'L', 'O', 'T' };
+  static constexpr uint32_t kVersion = 1;
+  static constexpr uint32_t kMaxPrefixLengths = 64;
+  static constexpr uint32_t kExemptFlag = 1;
+  static constexpr uint32_t kOccupiedFlag = 2;
+
+  // Table layout: header, `slotCount` slots of open addressing with linear probing, then the prefixes
+  struct Header {
+    char magic[4];
+    uint32_t version;
+    uint32_t slotCount;  // a power of two
+    uint32_t entryCount;
+    uint32_t prefixLengthCount;
+    // distinct prefix lengths, longest first, so the first match is the most specific one
+    uint32_t prefixLengths[kMaxPrefixLengths];
+    // keeps the slots that follow 8-byte aligned
+    uint32_t padding;
+  };
+  static_assert(sizeof(Header) == sizeof(uint32_t) * (6 + kMaxPrefixLengths), "Entries in `Header` are not aligned");
+  struct Slot {
+    uint64_t hash;
+    uint32_t prefixOffset;
+    uint32_t prefixSize;
+    RedisIntType maxAmount;
+    RedisIntType refillTimeMs;
+    RedisIntType refillAmount;
+    uint32_t flags;
+    uint32_t padding;
+  };
+  static_assert(sizeof(Slot) == sizeof(uint64_t) * 6, "Entries in `Slot` are not aligned");
+
+  static uint64_t hashPrefix(const char* data, size_t size);
+
+  RateLimitOverrideTable(std::unique_ptr<uint64_t[]> buffer, size_t size)
+      : buffer_(std::move(buffer)), data_(reinterpret_cast<const char*>(buffer_.get())), size_(size),
+        header_(reinterpret_cast<const Header*>(data_)),
+        slots_(reinterpret_cast<const Slot*>(data_ + sizeof(Header))) {}
+
+  std::unique_ptr<uint64_t[]> buffer_;
+  const char* data_;
+  size_t size_;
+  const Header* header_;
+  const Slot* slots_;
+};
+
+// Keeps the latest version of a table file loaded, checking the file for changes in the background.
+// A new version replaces the old one with an atomic pointer swap, so lookups are never paused by a reload; lookups
+// still holding the old version keep it alive until they finish.
+class RateLimitOverrideReloader {
+ public:
+  RateLimitOverrideReloader(std::string path, int reloadIntervalMs);
+  ~RateLimitOverrideReloader();
+
+  std::shared_ptr<const RateLimitOverrideTable> getTable() const { return std::atomic_load(&table_); }
+
+  // Load the file again if it changed since the last load; the current table stays in place if loading fails
+  void reloadIfChanged();
+
+ private:
+  void run();
+
+  const std::string path_;
+  const int reloadIntervalMs_;
+  std::shared_ptr<const RateLimitOverrideTable> table_;
+  // identity of the loaded file, which changes when a new table is renamed over it or it is rewritten in place
+  ino_t inode_ = 0;
+  int64_t mtimeNs_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable stopCv_;
+  bool stopping_ = false;
+  std::thread thread_;
+};
+
+}  // namespace ratelimit
+
+#endif  // RATELIMIT_RATELIMITOVERRIDETABLE_H_
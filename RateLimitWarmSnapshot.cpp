@@ -0,0 +1,178 @@
+#include "ratelimit/RateLimitWarmSnapshot.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "glog/logging.h"
+#include "rocksdb/options.h"
+
+namespace ratelimit {
+
+namespace {
+
+bool writeFully(int fd, const std::string& data) {
+  size_t offset = 0;
+  while (offset < data.size()) {
+    ssize_t written = ::write(fd, data.data() + offset, data.size() - offset);
+    if (written < 0 && errno == EINTR) continue;
+    if (written <= 0) return false;
+    offset += written;
+  }
+  return true;
+}
+
+}  // namespace
+
+rocksdb::Status RateLimitWarmSnapshot::write(rocksdb::DB* db, const std::string& path,
+                                             const std::vector<std::string>& keys) {
+  // persist the memtable so that the next startup has no WAL to replay
+  rocksdb::Status status = db->Flush(rocksdb::FlushOptions());
+  if (!status.ok()) return status;
+
+  // Write to a temporary file first so that a crash never leaves a truncated snapshot behind. The file is synced
+  // before the rename, and the directory after it, or a crash could still persist the rename without the data.
+  std::string buffer;
+  Header header;
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.keyCount = keys.size();
+  buffer.append(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (const auto& key : keys) {
+    uint32_t keySize = key.size();
+    buffer.append(reinterpret_cast<const char *>(&keySize), sizeof(keySize));
+    buffer.append(key.data(), keySize);
+  }
+  std::string tmpPath = path + ".tmp";
+  int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) return rocksdb::Status::IOError("Cannot create warm snapshot", tmpPath);
+  bool written = writeFully(fd, buffer) && ::fsync(fd) == 0;
+  if (::close(fd) != 0 || !written) return rocksdb::Status::IOError("Cannot write warm snapshot", tmpPath);
+  if (std::rename(tmpPath.c_str(), path.c_str()) != 0) {
+    return rocksdb::Status::IOError("Cannot rename warm snapshot", path);
+  }
+  std::string::size_type slash = path.rfind('/');
+  std::string dirPath = slash == std::string::npos ? "." : path.substr(0, std::max<size_t>(slash, 1));
+  int dirFd = ::open(dirPath.c_str(), O_RDONLY | O_DIRECTORY);
+  if (dirFd < 0) return rocksdb::Status::IOError("Cannot open warm snapshot directory", dirPath);
+  bool synced = ::fsync(dirFd) == 0;
+  ::close(dirFd);
+  if (!synced) return rocksdb::Status::IOError("Cannot sync warm snapshot directory", dirPath);
+  LOG(INFO) << "Wrote " << keys.size() << " keys to warm snapshot " << path;
+  return rocksdb::Status::OK();
+}
+
+rocksdb::Status RateLimitWarmSnapshot::preload(rocksdb::DB* db, const std::string& path, size_t* preloadedKeys) {
+  *preloadedKeys = 0;
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    if (errno == ENOENT) return rocksdb::Status::OK();
+    return rocksdb::Status::IOError("Cannot open warm snapshot", path);
+  }
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+    ::close(fd);
+    return rocksdb::Status::Corruption("Warm snapshot is truncated", path);
+  }
+  size_t size = st.st_size;
+  void* mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (mapped == MAP_FAILED) return rocksdb::Status::IOError("Cannot map warm snapshot", path);
+  ::madvise(mapped, size, MADV_SEQUENTIAL);
+
+  const char* data = static_cast<const char*>(mapped);
+  Header header;
+  std::memcpy(&header, data, sizeof(header));
+  rocksdb::Status status;
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion) {
+    status = rocksdb::Status::Corruption("Unknown warm snapshot format", path);
+  } else {
+    // keys point into the mapping, nothing is copied
+    std::vector<rocksdb::Slice> keys;
+    std::vector<std::string> values;
+    size_t offset = sizeof(header);
+    for (uint64_t i = 0; i < header.keyCount && status.ok(); i++) {
+      uint32_t keySize;
+      if (offset + sizeof(keySize) > size) {
+        status = rocksdb::Status::Corruption("Warm snapshot is truncated", path);
+        break;
+      }
+      std::memcpy(&keySize, data + offset, sizeof(keySize));
+      offset += sizeof(keySize);
+      if (offset + keySize > size) {
+        status = rocksdb::Status::Corruption("Warm snapshot is truncated", path);
+        break;
+      }
+      keys.emplace_back(data + offset, keySize);
+      offset += keySize;
+      if (keys.size() == kPreloadBatchSize || i + 1 == header.keyCount) {
+        // the values are not needed, reading them is what pulls their blocks into the cache
+        db->MultiGet(rocksdb::ReadOptions(), keys, &values);
+        *preloadedKeys += keys.size();
+        keys.clear();
+      }
+    }
+  }
+  ::munmap(mapped, size);
+  if (status.ok()) LOG(INFO) << "Preloaded " << *preloadedKeys << " keys from warm snapshot " << path;
+  return status;
+}
+
+RateLimitRecentKeys::RateLimitRecentKeys(size_t capacity)
+    : capacity_(capacity), stripeCapacity_((capacity + kStripes - 1) / kStripes), stripes_(new Stripe[kStripes]) {}
+
+void RateLimitRecentKeys::touch(const std::string& key, RateLimitRecentKeys::RedisIntType nowMs) {
+  Stripe& stripe = stripes_[std::hash<std::string>()(key) % kStripes];
+  std::lock_guard<std::mutex> _guard(stripe.mutex);
+  auto it = stripe.index.find(key);
+  if (it != stripe.index.end()) {
+    it->second->second = nowMs;
+    stripe.keys.splice(stripe.keys.begin(), stripe.keys, it->second);
+    return;
+  }
+  if (stripe.keys.size() >= stripeCapacity_) {
+    stripe.index.erase(stripe.keys.back().first);
+    stripe.keys.pop_back();
+  }
+  stripe.keys.emplace_front(key, nowMs);
+  stripe.index.emplace(key, stripe.keys.begin());
+}
+
+std::vector<std::string> RateLimitRecentKeys::getRecentKeys(RateLimitRecentKeys::RedisIntType nowMs,
+                                                            RateLimitRecentKeys::RedisIntType activeWithinMs) const {
+  std::vector<std::pair<RedisIntType, std::string>> entries;
+  for (size_t i = 0; i < kStripes; i++) {
+    const Stripe& stripe = stripes_[i];
+    std::lock_guard<std::mutex> _guard(stripe.mutex);
+    for (const auto& entry : stripe.keys) {
+      // stripes are ordered by recency, so the rest are older still
+      if (nowMs - entry.second > activeWithinMs) break;
+      entries.emplace_back(entry.second, entry.first);
+    }
+  }
+  std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.first > b.first; });
+  // stripes round their share of the capacity up, so together they may hold a few keys more
+  if (entries.size() > capacity_) entries.resize(capacity_);
+  std::vector<std::string> keys;
+  keys.reserve(entries.size());
+  for (auto& entry : entries) keys.push_back(std::move(entry.second));
+  return keys;
+}
+
+constexpr char RateLimitWarmSnapshot::kMagic[4];
+constexpr uint32_t RateLimitWarmSnapshot::kVersion;
+constexpr size_t RateLimitWarmSnapshot::kPreloadBatchSize;
+constexpr size_t RateLimitRecentKeys::kStripes;
+
+}  // namespace ratelimit
@@ -0,0 +1,78 @@
+#ifndef RATELIMIT_RATELIMITWARMSNAPSHOT_H_
+#define RATELIMIT_RATELIMITWARMSNAPSHOT_H_
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "codec/RedisValue.h"
+#include "rocksdb/db.h"
+#include "rocksdb/status.h"
+
+namespace ratelimit {
+
+// Snapshot of the keys of recently used buckets, written on clean shutdown and preloaded on startup so that a
+// restarted server does not serve its first minutes of traffic from a cold block cache.
+// Only keys are stored: the buckets themselves are in RocksDB, which is flushed before the snapshot is written so
+// that startup does not have to replay the WAL either.
+class RateLimitWarmSnapshot {
+ public:
+  using RedisIntType = codec::RedisValue::IntType;
+
+  // Flush the database and write `keys`, which should come most recent first
+  static rocksdb::Status write(rocksdb::DB* db, const std::string& path, const std::vector<std::string>& keys);
+  // Memory-map the snapshot at `path` and read every key in it to warm up the block cache
+  // Returns the number of keys read in `preloadedKeys`; a missing snapshot is not an error
+  static rocksdb::Status preload(rocksdb::DB* db, const std::string& path, size_t* preloadedKeys);
+
+ private:
+  static constexpr char kMagic[4] = { 'R', 'L', 'W', 'S' };
+  static constexpr uint32_t kVersion = 1;
+  static constexpr size_t kPreloadBatchSize = 256;
+
+  // Snapshot layout: header, then `keyCount` entries of a uint32_t key size followed by the key
+  struct Header {
+    char magic[4];
+    uint32_t version;
+    uint64_t keyCount;
+  };
+  static_assert(sizeof(Header) == 16, "Entries in `Header` are not aligned");
+};
+
+// The `capacity` most recently reduced keys, which is what makes it into the warm snapshot. Keys are spread over
+// independently locked stripes so that concurrent reduces rarely wait on each other, each evicting its least recently
+// reduced key once it holds its share of `capacity`.
+class RateLimitRecentKeys {
+ public:
+  using RedisIntType = codec::RedisValue::IntType;
+
+  explicit RateLimitRecentKeys(size_t capacity);
+
+  // Record that the bucket stored under `key` was reduced at `nowMs`
+  void touch(const std::string& key, RedisIntType nowMs);
+  // Keys reduced within `activeWithinMs` before `nowMs`, most recent first
+  std::vector<std::string> getRecentKeys(RedisIntType nowMs, RedisIntType activeWithinMs) const;
+
+ private:
+  static constexpr size_t kStripes = 64;
+
+  struct Stripe {
+    mutable std::mutex mutex;
+    // (key, reduced at) from most to least recent
+    std::list<std::pair<std::string, RedisIntType>> keys;
+    std::unordered_map<std::string, std::list<std::pair<std::string, RedisIntType>>::iterator> index;
+  };
+
+  const size_t capacity_;
+  const size_t stripeCapacity_;
+  std::unique_ptr<Stripe[]> stripes_;
+};
+
+}  // namespace ratelimit
+
+#endif  // RATELIMIT_RATELIMITWARMSNAPSHOT_H_